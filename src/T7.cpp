@@ -3,195 +3,456 @@
 
 namespace T7 {
 
-// T7CableEvent
+// T7LatencyStats
 
-T7CableEvent::T7CableEvent(T7Driver::PortDescriptor outPd, T7Driver::PortDescriptor inPd) {
-	this->outPd = outPd;
-	this->inPd = inPd;
+void T7LatencyStats::push(float ms) {
+	values[count % SIZE] = ms;
+	count++;
 }
 
-void T7CableEvent::removeCable(CableWidget* cw) {
+void T7LatencyStats::reset() {
+	count = 0;
+}
+
+int T7LatencyStats::size() {
+	return count < SIZE ? count : SIZE;
+}
+
+float T7LatencyStats::getMin() {
+	int n = size();
+	if (n == 0) return 0.f;
+	return *std::min_element(values, values + n);
+}
+
+float T7LatencyStats::getAvg() {
+	int n = size();
+	if (n == 0) return 0.f;
+	float sum = 0.f;
+	for (int i = 0; i < n; i++) sum += values[i];
+	return sum / n;
+}
+
+float T7LatencyStats::getP99() {
+	int n = size();
+	if (n == 0) return 0.f;
+	std::vector<float> v(values, values + n);
+	size_t k = std::min<size_t>(n - 1, (size_t)std::ceil(0.99f * n) - 1);
+	std::nth_element(v.begin(), v.begin() + k, v.end());
+	return v[k];
+}
+
+
+// T7PortIndex
+
+void T7PortIndex::update() {
+	modules.clear();
+	for (Widget* w : APP->scene->rack->getModuleContainer()->children) {
+		ModuleWidget* mw = dynamic_cast<ModuleWidget*>(w);
+		if (!mw || !mw->module) continue;
+		modules[mw->module->id].mw = mw;
+	}
+
+	inputCables.clear();
+	for (Widget* w : APP->scene->rack->getCableContainer()->children) {
+		CableWidget* cw = dynamic_cast<CableWidget*>(w);
+		if (!cw || !cw->isComplete()) continue;
+		inputCables[cw->inputPort] = cw;
+	}
+}
+
+void T7PortIndex::resolvePorts(ModuleEntry& m) {
+	for (PortWidget* pw : m.mw->getInputs()) {
+		if (pw->portId < 0) continue;
+		if ((int)m.inputs.size() <= pw->portId) m.inputs.resize(pw->portId + 1, NULL);
+		m.inputs[pw->portId] = pw;
+	}
+	for (PortWidget* pw : m.mw->getOutputs()) {
+		if (pw->portId < 0) continue;
+		if ((int)m.outputs.size() <= pw->portId) m.outputs.resize(pw->portId + 1, NULL);
+		m.outputs[pw->portId] = pw;
+	}
+	m.resolved = true;
+}
+
+ModuleWidget* T7PortIndex::getModule(int64_t moduleId) {
+	auto it = modules.find(moduleId);
+	return it != modules.end() ? it->second.mw : NULL;
+}
+
+PortWidget* T7PortIndex::getPort(int64_t moduleId, int portType, int portId) {
+	auto it = modules.find(moduleId);
+	if (it == modules.end() || portId < 0) return NULL;
+	if (!it->second.resolved) resolvePorts(it->second);
+	const std::vector<PortWidget*>& ports = portType == 0 ? it->second.outputs : it->second.inputs;
+	return portId < (int)ports.size() ? ports[portId] : NULL;
+}
+
+CableWidget* T7PortIndex::getInputCable(PortWidget* inPort) {
+	auto it = inputCables.find(inPort);
+	return it != inputCables.end() ? it->second : NULL;
+}
+
+void T7PortIndex::addCable(CableWidget* cw) {
+	inputCables[cw->inputPort] = cw;
+}
+
+void T7PortIndex::removeCable(CableWidget* cw) {
+	auto it = inputCables.find(cw->inputPort);
+	if (it != inputCables.end() && it->second == cw) inputCables.erase(it);
+}
+
+
+// T7EventExecutor
+
+void T7EventExecutor::beginBatch() {
+	endBatch();
+	batch = new history::ComplexAction;
+	batch->name = "patch cables";
+	index.update();
+}
+
+void T7EventExecutor::endBatch() {
+	if (!batch) return;
+	if (batch->isEmpty()) {
+		delete batch;
+	}
+	else {
+		APP->history->push(batch);
+	}
+	batch = NULL;
+}
+
+void T7EventExecutor::pushHistory(history::Action* h) {
+	if (batch) batch->push(h);
+	else APP->history->push(h);
+}
+
+T7EventType T7EventExecutor::execute(const T7Event& e) {
+	switch (e.type) {
+		case T7EventType::CABLE_TOGGLE:
+			return cableToggle(e);
+		case T7EventType::CABLE_ADD:
+			return cableAdd(e);
+		case T7EventType::CABLE_REMOVE:
+			return cableRemove(e);
+		case T7EventType::CABLE_SCENE:
+			return cableScene(e);
+		default:
+			return T7EventType::NONE;
+	}
+}
+
+void T7EventExecutor::removeCable(CableWidget* cw) {
 	// history::CableRemove
 	history::CableRemove* h = new history::CableRemove;
 	h->setCable(cw);
-	APP->history->push(h);
+	pushHistory(h);
+	index.removeCable(cw);
 	APP->scene->rack->removeCable(cw);
 	delete cw;
 }
 
-void T7CableEvent::addCable(CableWidget* cw) {
+void T7EventExecutor::addCable(CableWidget* cw) {
 	APP->scene->rack->addCable(cw);
+	index.addCable(cw);
 	// history::CableAdd
 	history::CableAdd* h = new history::CableAdd;
 	h->setCable(cw);
-	APP->history->push(h);
+	pushHistory(h);
 }
 
-CableWidget* T7CableEvent::findCable(ModuleWidget* outputModule, ModuleWidget* inputModule) {
-	for (PortWidget* outPort : outputModule->getOutputs()) {
-		if (outPort->portId == outPd.portId) {
-			for (CableWidget* cw : APP->scene->rack->getCablesOnPort(outPort)) {
-				if (cw->inputPort->portId == inPd.portId) {
-					// Cable found
-					return cw;
-				}
-			}
-			break;
+CableWidget* T7EventExecutor::findCable(PortWidget* outPort, PortWidget* inPort) {
+	CableWidget* cw = index.getInputCable(inPort);
+	return cw && cw->outputPort == outPort ? cw : NULL;
+}
+
+bool T7EventExecutor::patchCable(PortWidget* outPort, PortWidget* inPort, bool replaceInputCable, const NVGcolor* color) {
+	CableWidget* cw1 = index.getInputCable(inPort);
+	if (cw1) {
+		// Input has a cable
+		if (replaceInputCable) {
+			removeCable(cw1);
+		}
+		else {
+			log("input port occupied");
+			return false;
 		}
 	}
-	return NULL;
-}
 
+	engine::Cable* c = new engine::Cable;
+	c->outputId = outPort->portId;
+	c->outputModule = outPort->module;
+	c->inputId = inPort->portId;
+	c->inputModule = inPort->module;
+	APP->engine->addCable(c);
 
-// T7CableToggleEvent
+	CableWidget* cw = new CableWidget;
+	cw->setCable(c);
+	if (color) {
+		cw->color = *color;
+	}
+	addCable(cw);
+	log("cable patched");
 
-T7CableToggleEvent::T7CableToggleEvent(T7Driver::PortDescriptor outPd, T7Driver::PortDescriptor inPd)
-	: T7CableEvent(outPd, inPd) {
+	// TODO: incomplete cables?
+	// log("cable incomplete");
+	return true;
 }
 
-void T7CableToggleEvent::execute() {
-	ModuleWidget* outputModule = APP->scene->rack->getModule(outPd.moduleId);
-	ModuleWidget* inputModule = APP->scene->rack->getModule(inPd.moduleId);
-	if (!outputModule || !inputModule) return;
+T7EventType T7EventExecutor::cableToggle(const T7Event& e) {
+	PortWidget* outPort = index.getPort(e.outPd.moduleId, 0, e.outPd.portId);
+	PortWidget* inPort = index.getPort(e.inPd.moduleId, 1, e.inPd.portId);
+	if (!outPort || !inPort) return T7EventType::NONE;
 
 	// NB: unstable API from here on...
 	// ---
 	// Check if cable already exists
-	CableWidget* cable = findCable(outputModule, inputModule);
+	CableWidget* cable = findCable(outPort, inPort);
 	if (cable) {
 		// Remove existing cable
 		removeCable(cable);
 		log("cable removed");
+		return T7EventType::CABLE_REMOVE;
 	}
 	else {
 		// Add new cable
-		engine::Cable* c = new engine::Cable;
-		c->outputId = outPd.portId;
-		c->outputModule = outputModule->module;
-		c->inputId = inPd.portId;
-		c->inputModule = inputModule->module;
-
-		for (PortWidget* inPort : inputModule->getInputs()) {
-			if (inPort->portId == inPd.portId) {
-				// Input port found
-				if (APP->scene->rack->getCablesOnPort(inPort).size() > 0) {
-					// Input has a cable
-					if (replaceInputCable) {
-						CableWidget* cw1 = APP->scene->rack->getCablesOnPort(inPort).front();
-						removeCable(cw1);
-					}
-					else {
-						log("input port occupied");
-						break;
-					}
-				}
-				break;
-			}
-		}
-
-		APP->engine->addCable(c);
-
-		CableWidget* cw = new CableWidget;
-		cw->setCable(c);
-		if (cableColor != "") {
-			cw->color = color::fromHexString(cableColor);
-		}
-		addCable(cw);
-		log("cable patched");
-
-		// TODO: incomplete cables?
-		// log("cable incomplete");
+		bool patched = patchCable(outPort, inPort, e.replaceInputCable, e.hasCableColor ? &e.cableColor : NULL);
+		return patched ? T7EventType::CABLE_ADD : T7EventType::NONE;
 	}
 	// ---
 }
 
-
-// T7CableAddEvent
-
-T7CableAddEvent::T7CableAddEvent(T7Driver::PortDescriptor outPd, T7Driver::PortDescriptor inPd)
-	: T7CableEvent(outPd, inPd) {
-}
-
-void T7CableAddEvent::execute() {
-	ModuleWidget* outputModule = APP->scene->rack->getModule(outPd.moduleId);
-	ModuleWidget* inputModule = APP->scene->rack->getModule(inPd.moduleId);
-	if (!outputModule || !inputModule) return;
+T7EventType T7EventExecutor::cableAdd(const T7Event& e) {
+	PortWidget* outPort = index.getPort(e.outPd.moduleId, 0, e.outPd.portId);
+	PortWidget* inPort = index.getPort(e.inPd.moduleId, 1, e.inPd.portId);
+	if (!outPort || !inPort) return T7EventType::NONE;
 
 	// NB: unstable API from here on...
 	// ---
 	// Check if cable already exists
-	CableWidget* cable = findCable(outputModule, inputModule);
+	CableWidget* cable = findCable(outPort, inPort);
 	if (cable) {
 		log("cable already patched");
-		return;
+		return T7EventType::NONE;
 	}
 	else {
 		// Add new cable
-		engine::Cable* c = new engine::Cable;
-		c->outputId = outPd.portId;
-		c->outputModule = outputModule->module;
-		c->inputId = inPd.portId;
-		c->inputModule = inputModule->module;
-
-		for (PortWidget* inPort : inputModule->getInputs()) {
-			if (inPort->portId == inPd.portId) {
-				// Input port found
-				if (APP->scene->rack->getCablesOnPort(inPort).size() > 0) {
-					// Input has a cable
-					if (replaceInputCable) {
-						CableWidget* cw1 = APP->scene->rack->getCablesOnPort(inPort).front();
-						removeCable(cw1);
-					}
-					else {
-						log("input port occupied");
-						break;
-					}
-				}
-				break;
-			}
-		}
-
-		APP->engine->addCable(c);
-
-		CableWidget* cw = new CableWidget;
-		cw->setCable(c);
-		if (cableColor != "") {
-			cw->color = color::fromHexString(cableColor);
-		}
-		addCable(cw);
-		log("cable patched");
-
-		// TODO: incomplete cables?
-		// log("cable incomplete");
+		bool patched = patchCable(outPort, inPort, e.replaceInputCable, e.hasCableColor ? &e.cableColor : NULL);
+		return patched ? T7EventType::CABLE_ADD : T7EventType::NONE;
 	}
 	// ---
 }
 
-
-// T7CableRemoveEvent
-
-T7CableRemoveEvent::T7CableRemoveEvent(T7Driver::PortDescriptor outPd, T7Driver::PortDescriptor inPd)
-	: T7CableEvent(outPd, inPd) {
-}
-
-void T7CableRemoveEvent::execute() {
-	ModuleWidget* outputModule = APP->scene->rack->getModule(outPd.moduleId);
-	ModuleWidget* inputModule = APP->scene->rack->getModule(inPd.moduleId);
-	if (!outputModule || !inputModule) return;
+T7EventType T7EventExecutor::cableRemove(const T7Event& e) {
+	PortWidget* outPort = index.getPort(e.outPd.moduleId, 0, e.outPd.portId);
+	PortWidget* inPort = index.getPort(e.inPd.moduleId, 1, e.inPd.portId);
+	if (!outPort || !inPort) return T7EventType::NONE;
 
 	// NB: unstable API from here on...
 	// ---
 	// Check if cable already exists
-	CableWidget* cable = findCable(outputModule, inputModule);
+	CableWidget* cable = findCable(outPort, inPort);
 	if (cable) {
 		// Remove existing cable
 		removeCable(cable);
 		log("cable removed");
+		return T7EventType::CABLE_REMOVE;
 	}
 	else {
 		log("no cable to remove");
+		return T7EventType::NONE;
+	}
+	// ---
+}
+
+T7EventType T7EventExecutor::cableScene(const T7Event& e) {
+	const std::vector<T7CableDescriptor>* cables = e.driver ? e.driver->getCableScene(e.sceneId) : NULL;
+	if (!cables) {
+		log("unknown scene");
+		return T7EventType::NONE;
+	}
+	applyCableSet(*cables);
+	log(string::f("scene %i", e.sceneId + 1));
+	return T7EventType::CABLE_SCENE;
+}
+
+void T7EventExecutor::applyCableSet(const std::vector<T7CableDescriptor>& cables) {
+	// Target cables keyed by their input, a later cable on the same input wins
+	// as inputs accept only one cable
+	std::unordered_map<T7CableEdge, const T7CableDescriptor*, T7CableEdgeHash> target;
+	target.reserve(cables.size());
+	for (const T7CableDescriptor& c : cables) {
+		target[T7CableEdge::input(c.inModuleId, c.inPortId)] = &c;
 	}
+
+	// NB: unstable API from here on...
 	// ---
+	// Cables of the rack which are not part of the target set get removed,
+	// the others are already in place and need no engine mutation
+	std::vector<CableWidget*> removeCables;
+	std::unordered_set<T7CableEdge, T7CableEdgeHash> kept;
+	for (auto p : index.inputCables) {
+		CableWidget* cw = p.second;
+		T7CableEdge key = T7CableEdge::input(cw->inputPort->module->id, cw->inputPort->portId);
+		auto it = target.find(key);
+		if (it != target.end() && T7CableEdge(*it->second) == T7CableEdge(cw)) kept.insert(key);
+		else removeCables.push_back(cw);
+	}
+	for (CableWidget* cw : removeCables) {
+		removeCable(cw);
+	}
+
+	// Add missing cables
+	int added = 0;
+	for (auto p : target) {
+		if (kept.find(p.first) != kept.end()) continue;
+		const T7CableDescriptor& c = *p.second;
+		PortWidget* outPort = index.getPort(c.outModuleId, 0, c.outPortId);
+		PortWidget* inPort = index.getPort(c.inModuleId, 1, c.inPortId);
+		if (!outPort || !inPort) continue;
+		patchCable(outPort, inPort, true, &c.color);
+		added++;
+	}
+	// ---
+
+	log(string::f("%i cables removed, %i added, %i kept", (int)removeCables.size(), added, (int)kept.size()));
+}
+
+// T7Recorder
+
+void T7Recorder::startRecording(int64_t frame, float sampleRate) {
+	entries.clear();
+	this->sampleRate = sampleRate;
+	length = 0;
+	startFrame = frame;
+	state = State::RECORDING;
+}
+
+void T7Recorder::record(const T7Event& e, T7EventType type, int64_t frame) {
+	if (state != State::RECORDING || type == T7EventType::NONE) return;
+	Entry en;
+	std::memset(&en, 0, sizeof(en));
+	// Keep the log ordered, events might be executed slightly out of order of their arrival
+	int64_t f = (e.frame >= 0 ? e.frame : frame) - startFrame;
+	if (!entries.empty()) f = std::max(f, entries.back().frame);
+	en.frame = std::max<int64_t>(f, 0);
+	// A toggle is recorded as the change it made, replaying it against other cables would diverge
+	en.type = (uint8_t)type;
+	en.outModuleId = e.outPd.moduleId;
+	en.outPortId = e.outPd.portId;
+	en.inModuleId = e.inPd.moduleId;
+	en.inPortId = e.inPd.portId;
+	en.sceneId = e.sceneId;
+	en.replaceInputCable = e.replaceInputCable;
+	if (e.hasCableColor) {
+		en.color = packColor(e.cableColor);
+		en.hasColor = 1;
+	}
+	entries.push_back(en);
+}
+
+void T7Recorder::startPlayback(int64_t frame, float sampleRate) {
+	if (state == State::RECORDING) stop(frame);
+	if (entries.empty() || this->sampleRate <= 0.f) return;
+	frameScale = sampleRate / this->sampleRate;
+	startFrame = frame;
+	position = 0;
+	state = State::PLAYING;
+}
+
+void T7Recorder::stop(int64_t frame) {
+	if (state == State::RECORDING) length = frame - startFrame;
+	state = State::IDLE;
+}
+
+void T7Recorder::play(int64_t frame, T7EventExecutor& executor) {
+	if (state != State::PLAYING) return;
+	bool batch = false;
+	while (true) {
+		if (position >= entries.size()) {
+			if (!loop || length <= 0) {
+				state = State::IDLE;
+				break;
+			}
+			position = 0;
+			// At least one frame per pass, passes missed while the UI was stalled are skipped
+			int64_t loopLength = std::max<int64_t>(1, (int64_t)(length * frameScale));
+			startFrame += loopLength;
+			if (frame - startFrame >= loopLength) startFrame += (frame - startFrame) / loopLength * loopLength;
+		}
+		const Entry& en = entries[position];
+		if (startFrame + (int64_t)(en.frame * frameScale) > frame) break;
+
+		event.type = (T7EventType)en.type;
+		event.frame = -1;
+		event.outPd.moduleId = en.outModuleId;
+		event.outPd.portType = 0;
+		event.outPd.portId = en.outPortId;
+		event.inPd.moduleId = en.inModuleId;
+		event.inPd.portType = 1;
+		event.inPd.portId = en.inPortId;
+		event.replaceInputCable = en.replaceInputCable;
+		event.driver = sceneDriver;
+		event.sceneId = en.sceneId;
+		event.hasCableColor = en.hasColor;
+		if (en.hasColor) event.cableColor = unpackColor(en.color);
+
+		// All entries due in this frame result in a single undo step
+		if (!batch) {
+			executor.beginBatch();
+			batch = true;
+		}
+		executor.execute(event);
+		position++;
+	}
+	if (batch) executor.endBatch();
+}
+
+float T7Recorder::getSeconds() {
+	return sampleRate > 0.f ? length / sampleRate : 0.f;
+}
+
+json_t* T7Recorder::toJson() {
+	Header h;
+	h.version = VERSION;
+	h.count = entries.size();
+	h.sampleRate = sampleRate;
+	h.reserved = 0;
+	h.length = length;
+	std::vector<uint8_t> data(sizeof(h) + entries.size() * sizeof(Entry));
+	std::memcpy(data.data(), &h, sizeof(h));
+	if (!entries.empty()) std::memcpy(data.data() + sizeof(h), entries.data(), entries.size() * sizeof(Entry));
+
+	json_t* recordingJ = json_object();
+	json_object_set_new(recordingJ, "data", json_string(string::toBase64(data).c_str()));
+	json_object_set_new(recordingJ, "loop", json_boolean(loop));
+	return recordingJ;
+}
+
+void T7Recorder::fromJson(json_t* recordingJ) {
+	state = State::IDLE;
+	entries.clear();
+	length = 0;
+	sampleRate = 0.f;
+	loop = json_boolean_value(json_object_get(recordingJ, "loop"));
+
+	json_t* dataJ = json_object_get(recordingJ, "data");
+	if (!json_is_string(dataJ)) return;
+	std::vector<uint8_t> data;
+	try {
+		data = string::fromBase64(json_string_value(dataJ));
+	}
+	catch (Exception& e) {
+		return;
+	}
+	Header h;
+	if (data.size() < sizeof(h)) return;
+	std::memcpy(&h, data.data(), sizeof(h));
+	if (h.version != VERSION || data.size() != sizeof(h) + (size_t)h.count * sizeof(Entry)) return;
+	entries.resize(h.count);
+	if (h.count > 0) std::memcpy(entries.data(), data.data() + sizeof(h), h.count * sizeof(Entry));
+	sampleRate = h.sampleRate;
+	length = h.length;
 }
 
 } // namespace T7
\ No newline at end of file
@@ -1,5 +1,8 @@
 #pragma once
 #include "plugin.hpp"
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
 
 namespace T7 {
 
@@ -8,12 +11,7 @@ struct T7EventLogger {
 	virtual void log(std::string s) {}
 };
 
-struct T7Event {
-	T7EventLogger* logger = NULL; // not owned
-	virtual ~T7Event() {}
-	virtual void execute() {}
-	void log(std::string s) { if (logger) logger->log(s); }
-};
+struct T7Event;
 
 
 enum class T7MessageType {
@@ -28,10 +26,181 @@ struct T7MidiMessage : T7Message {
 	midi::Message msg;
 	int driverId;
 	int deviceId;
+	/** Engine frame of arrival */
+	int64_t frame;
 	T7MidiMessage() { type = T7MessageType::MIDI; }
 };
 
 
+/**
+ * Fixed-capacity ring buffer for one producer thread and one consumer thread.
+ * All slots are preallocated, elements are written and read in place so neither
+ * side allocates or copies more than the payload itself.
+ * S must be a power of 2.
+ */
+template < typename T, size_t S >
+struct T7SpscRing {
+	static_assert(S > 0 && (S & (S - 1)) == 0, "T7SpscRing capacity must be a power of 2");
+
+	T data[S];
+	std::atomic<size_t> start{0};
+	std::atomic<size_t> end{0};
+	/** Number of elements rejected because the ring was full, written by the producer only */
+	std::atomic<uint32_t> overflowCount{0};
+
+	/** Producer: returns the next free slot or NULL (and counts an overflow) if the ring is full */
+	T* beginPush() {
+		size_t e = end.load(std::memory_order_relaxed);
+		if (e - start.load(std::memory_order_acquire) >= S) {
+			overflowCount.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		}
+		return &data[e & (S - 1)];
+	}
+	/** Producer: publishes the slot returned by beginPush() */
+	void endPush() {
+		end.store(end.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	bool push(const T& t) {
+		T* slot = beginPush();
+		if (!slot) return false;
+		*slot = t;
+		endPush();
+		return true;
+	}
+
+	/** Consumer: returns the oldest element or NULL if the ring is empty */
+	T* front() {
+		size_t s = start.load(std::memory_order_relaxed);
+		if (s == end.load(std::memory_order_acquire)) return NULL;
+		return &data[s & (S - 1)];
+	}
+	/** Consumer: releases the element returned by front() */
+	void pop() {
+		start.store(start.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool empty() const { return start.load(std::memory_order_acquire) == end.load(std::memory_order_acquire); }
+	bool full() const { return size() >= S; }
+	size_t size() const { return end.load(std::memory_order_acquire) - start.load(std::memory_order_acquire); }
+	size_t capacity() const { return S; }
+};
+
+typedef T7SpscRing<T7MidiMessage, 1024> T7MidiQueue;
+
+
+/**
+ * Hands immutable versions of data built on the UI thread over to the engine thread
+ * without locking. The engine thread switches to the latest published version in get()
+ * and retires the version it used before. Retired versions are deleted on the UI thread
+ * by the next publish(), so a version is never freed while the engine thread reads it.
+ */
+template < typename T >
+struct T7Exchange {
+	/** Version in use by the engine thread */
+	T* current;
+	/** Latest published version, UI thread only */
+	T* latest;
+	/** Published version not yet picked up by the engine thread */
+	std::atomic<T*> pending{NULL};
+	T7SpscRing<T*, 16> retired;
+
+	T7Exchange() {
+		current = latest = new T();
+	}
+
+	~T7Exchange() {
+		delete pending.exchange(NULL);
+		collect();
+		delete current;
+	}
+
+	/** UI thread: publishes t and takes ownership of it */
+	void publish(T* t) {
+		collect();
+		latest = t;
+		// A version the engine thread has not picked up is replaced and never read
+		delete pending.exchange(t, std::memory_order_acq_rel);
+	}
+
+	/** UI thread: deletes the versions retired by the engine thread */
+	void collect() {
+		T** t;
+		while ((t = retired.front())) {
+			delete *t;
+			retired.pop();
+		}
+	}
+
+	/** Engine thread: returns the latest version picked up */
+	T* get() {
+		if (pending.load(std::memory_order_relaxed) && !retired.full()) {
+			T* t = pending.exchange(NULL, std::memory_order_acq_rel);
+			if (t) {
+				retired.push(current);
+				current = t;
+			}
+		}
+		return current;
+	}
+};
+
+
+/**
+ * Expander message of T7-CTRL, shared by all T7-MIDI modules chained to its right.
+ * The T7-MIDI at chain position i is the only producer of lane i, T7-CTRL the only
+ * consumer of all lanes, so a message is written once regardless of chain length.
+ */
+struct T7MidiChain {
+	static const int MAX_LENGTH = 8;
+	/** Mappings use device 0 for messages of any T7-MIDI, 1..MAX_LENGTH for a single one */
+	static const int MAX_DEVICES = MAX_LENGTH + 1;
+	T7MidiQueue lanes[MAX_LENGTH];
+};
+
+
+/** Cable between two ports identified by module and port ids */
+struct T7CableDescriptor {
+	int64_t outModuleId = -1;
+	int outPortId = -1;
+	int64_t inModuleId = -1;
+	int inPortId = -1;
+	NVGcolor color;
+};
+
+
+/** Identity of a cable without its appearance, used as hash key */
+struct T7CableEdge {
+	int64_t outModuleId;
+	int outPortId;
+	int64_t inModuleId;
+	int inPortId;
+
+	T7CableEdge(int64_t outModuleId, int outPortId, int64_t inModuleId, int inPortId) : outModuleId(outModuleId), outPortId(outPortId), inModuleId(inModuleId), inPortId(inPortId) {}
+	T7CableEdge(const T7CableDescriptor& c) : outModuleId(c.outModuleId), outPortId(c.outPortId), inModuleId(c.inModuleId), inPortId(c.inPortId) {}
+	T7CableEdge(CableWidget* cw) : outModuleId(cw->outputPort->module->id), outPortId(cw->outputPort->portId), inModuleId(cw->inputPort->module->id), inPortId(cw->inputPort->portId) {}
+
+	/** Key of an input port only */
+	static T7CableEdge input(int64_t inModuleId, int inPortId) {
+		return T7CableEdge(-1, -1, inModuleId, inPortId);
+	}
+
+	bool operator==(const T7CableEdge& e) const {
+		return outModuleId == e.outModuleId && outPortId == e.outPortId && inModuleId == e.inModuleId && inPortId == e.inPortId;
+	}
+};
+
+struct T7CableEdgeHash {
+	size_t operator()(const T7CableEdge& e) const {
+		size_t h = std::hash<int64_t>()(e.outModuleId);
+		h = h * 31 + std::hash<int>()(e.outPortId);
+		h = h * 31 + std::hash<int64_t>()(e.inModuleId);
+		h = h * 31 + std::hash<int>()(e.inPortId);
+		return h;
+	}
+};
+
+
 struct T7Driver {
 	struct PortDescriptor {
 		int64_t moduleId = -1;
@@ -42,38 +211,215 @@ struct T7Driver {
 	virtual ~T7Driver() {}
 	virtual std::string getName() { return ""; }
 	virtual void toJson(json_t* driverJ) {}
-	virtual void fromJson(json_t* driverJ) {}
+	/** Compiles the mapping of driverJ, invalid entries are skipped and described in errors */
+	virtual void fromJson(json_t* driverJ, std::vector<std::string>& errors) {}
 	virtual void exampleJson(json_t* driverJ) {}
 	virtual void reset() {}
-	virtual bool processMessage(midi::Message msg) { return false; }
-	virtual T7Event* getEvent() { return NULL; }
+	/** Bit n is set if the driver processes MIDI messages of status n */
+	virtual uint16_t getStatusMask() { return 0; }
+	/**
+	 * False if messages of status, channel and number from device can never result in an
+	 * event, UI thread only
+	 */
+	virtual bool isMapped(int device, uint8_t status, uint8_t channel, uint8_t number) { return true; }
+	/** device is the position of the T7-MIDI in the chain starting at 1, see T7MidiChain */
+	virtual bool processMessage(int device, const midi::Message& msg) { return false; }
+	/** Fills e with the event of the last processed message, returns false if there is none */
+	virtual bool getEvent(T7Event* e) { return false; }
+	/** Stored cable set of a scene, UI thread only */
+	virtual const std::vector<T7CableDescriptor>* getCableScene(int sceneId) { return NULL; }
 };
 
 
-struct T7CableEvent : T7Event {
+enum class T7EventType {
+	NONE = 0,
+	CABLE_TOGGLE = 1,
+	CABLE_ADD = 2,
+	CABLE_REMOVE = 3,
+	CABLE_SCENE = 4
+};
+
+/** Packs a color into RGBA bytes for compact storage */
+inline uint32_t packColor(NVGcolor c) {
+	return ((uint32_t)(c.r * 255.f + 0.5f) << 24) | ((uint32_t)(c.g * 255.f + 0.5f) << 16) | ((uint32_t)(c.b * 255.f + 0.5f) << 8) | (uint32_t)(c.a * 255.f + 0.5f);
+}
+
+inline NVGcolor unpackColor(uint32_t c) {
+	return nvgRGBA((c >> 24) & 0xff, (c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+}
+
+/**
+ * Plain value type, events live in preallocated ring slots which are recycled
+ * between the engine thread (producer) and the UI thread (consumer).
+ */
+struct T7Event {
+	T7EventType type = T7EventType::NONE;
+	/** Engine frame of the MIDI message which caused the event */
+	int64_t frame = -1;
 	T7Driver::PortDescriptor outPd;
 	T7Driver::PortDescriptor inPd;
-	std::string cableColor = "";
+	/** Parsed when the mapping is loaded, only valid if hasCableColor is set */
+	NVGcolor cableColor;
+	bool hasCableColor = false;
 	bool replaceInputCable = false;
-	T7CableEvent(T7Driver::PortDescriptor outPd, T7Driver::PortDescriptor inPd);
-	void removeCable(CableWidget* cw);
-	void addCable(CableWidget* cw);
-	CableWidget* findCable(ModuleWidget* outputModule, ModuleWidget* inputModule);
+	/** CABLE_SCENE: owner and id of the scene */
+	T7Driver* driver = NULL;
+	int sceneId = -1;
 };
 
-struct T7CableToggleEvent : T7CableEvent {
-	T7CableToggleEvent(T7Driver::PortDescriptor outPd, T7Driver::PortDescriptor inPd);
-	void execute() override;
+typedef T7SpscRing<T7Event, 64> T7EventQueue;
+
+
+/** Latency between MIDI arrival and execution of events in milliseconds, UI thread only */
+struct T7LatencyStats {
+	static const int SIZE = 512;
+	/** The last SIZE latencies */
+	float values[SIZE];
+	int count = 0;
+
+	void push(float ms);
+	void reset();
+	int size();
+	float getMin();
+	float getAvg();
+	/** 99th percentile */
+	float getP99();
+};
+
+
+/**
+ * Index of module widgets, port widgets and input cables by id for the UI thread.
+ * Widgets are deleted and recreated outside of T7 (module removal, undo), so pointers
+ * are valid until the next update() only: update() resolves module widgets by module
+ * id, their ports are resolved on first use and input cables are indexed on every
+ * update() and incrementally on addCable()/removeCable().
+ */
+struct T7PortIndex {
+	struct ModuleEntry {
+		ModuleWidget* mw;
+		bool resolved = false;
+		/** Indexed by portId */
+		std::vector<PortWidget*> inputs;
+		std::vector<PortWidget*> outputs;
+	};
+
+	std::unordered_map<int64_t, ModuleEntry> modules;
+	/** Inputs accept only one cable */
+	std::unordered_map<PortWidget*, CableWidget*> inputCables;
+
+	/** Drops all widget pointers and indexes the current widgets of the rack */
+	void update();
+	void resolvePorts(ModuleEntry& m);
+	ModuleWidget* getModule(int64_t moduleId);
+	/** portType 0 = output, 1 = input */
+	PortWidget* getPort(int64_t moduleId, int portType, int portId);
+	CableWidget* getInputCable(PortWidget* inPort);
+	void addCable(CableWidget* cw);
+	void removeCable(CableWidget* cw);
 };
 
-struct T7CableAddEvent : T7CableEvent {
-	T7CableAddEvent(T7Driver::PortDescriptor outPd, T7Driver::PortDescriptor inPd);
-	void execute() override;
+
+/** Executes events on the UI thread, execute() must be called within a batch */
+struct T7EventExecutor {
+	T7EventLogger* logger = NULL; // not owned
+	T7PortIndex index;
+	/** History of the current batch, NULL if no batch is running */
+	history::ComplexAction* batch = NULL;
+
+	/** Collects all following cable changes into one history entry */
+	void beginBatch();
+	void endBatch();
+	/**
+	 * Returns the change made by e: CABLE_TOGGLE resolves to CABLE_ADD or CABLE_REMOVE
+	 * depending on the current cables, NONE if nothing has changed
+	 */
+	T7EventType execute(const T7Event& e);
+	void log(std::string s) { if (logger) logger->log(s); }
+	void pushHistory(history::Action* h);
+
+	T7EventType cableToggle(const T7Event& e);
+	T7EventType cableAdd(const T7Event& e);
+	T7EventType cableRemove(const T7Event& e);
+	T7EventType cableScene(const T7Event& e);
+	/**
+	 * Replaces all cables of the rack by cables: computes the difference between both
+	 * sets and removes or adds only cables which differ, removals first. A scene defines
+	 * the cable of every input, so it always replaces input cables regardless of the
+	 * "Replace input cables" option.
+	 */
+	void applyCableSet(const std::vector<T7CableDescriptor>& cables);
+	/** color may be NULL for the default cable color, returns false if the input is occupied */
+	bool patchCable(PortWidget* outPort, PortWidget* inPort, bool replaceInputCable, const NVGcolor* color);
+	void removeCable(CableWidget* cw);
+	void addCable(CableWidget* cw);
+	CableWidget* findCable(PortWidget* outPort, PortWidget* inPort);
 };
 
-struct T7CableRemoveEvent : T7CableEvent {
-	T7CableRemoveEvent(T7Driver::PortDescriptor outPd, T7Driver::PortDescriptor inPd);
-	void execute() override;
+
+/**
+ * Records executed events with their engine frame into an append-only log of fixed-size
+ * entries and replays them in sync with the engine, UI thread only.
+ */
+struct T7Recorder {
+	struct Entry {
+		/** Frames since the start of the recording */
+		int64_t frame;
+		int64_t outModuleId;
+		int64_t inModuleId;
+		int32_t outPortId;
+		int32_t inPortId;
+		/** Packed RGBA, see hasColor */
+		uint32_t color;
+		/** CABLE_SCENE only */
+		int16_t sceneId;
+		uint8_t type;
+		uint8_t hasColor : 1;
+		uint8_t replaceInputCable : 1;
+	};
+
+	struct Header {
+		uint32_t version;
+		uint32_t count;
+		float sampleRate;
+		uint32_t reserved;
+		int64_t length;
+	};
+
+	static const uint32_t VERSION = 1;
+
+	enum class State {
+		IDLE,
+		RECORDING,
+		PLAYING
+	};
+
+	State state = State::IDLE;
+	std::vector<Entry> entries;
+	float sampleRate = 0.f;
+	/** Frames from the start to the end of the recording */
+	int64_t length = 0;
+	bool loop = false;
+	/** Owner of recorded scenes, not owned */
+	T7Driver* sceneDriver = NULL;
+
+	int64_t startFrame = 0;
+	/** Engine frames per recorded frame during playback */
+	double frameScale = 1.0;
+	/** Next entry to be replayed */
+	size_t position = 0;
+	/** Reused for every replayed entry */
+	T7Event event;
+
+	void startRecording(int64_t frame, float sampleRate);
+	/** type is the change made by e, see T7EventExecutor::execute(), NONE is not recorded */
+	void record(const T7Event& e, T7EventType type, int64_t frame);
+	void startPlayback(int64_t frame, float sampleRate);
+	void stop(int64_t frame);
+	/** Executes all entries which are due at frame */
+	void play(int64_t frame, T7EventExecutor& executor);
+	float getSeconds();
+	json_t* toJson();
+	void fromJson(json_t* recordingJ);
 };
 
 } // namespace T7
\ No newline at end of file
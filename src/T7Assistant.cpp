@@ -1,5 +1,6 @@
 #include "plugin.hpp"
 #include "T7.hpp"
+#include "osdialog.h"
 
 namespace T7 {
 
@@ -24,27 +25,74 @@ struct T7AssistantModule : Module {
 };
 
 
+/** Port lists of a module, rendered once per module */
+struct PortDescription {
+	ModuleWidget* mw = NULL;
+	struct Port {
+		int portType;
+		int portId;
+		std::string text;
+	};
+	std::vector<Port> inputs;
+	std::vector<Port> outputs;
+
+	static std::string portName(PortWidget* pw) {
+		engine::PortInfo* info = pw->getPortInfo();
+		return info ? info->getName() : "";
+	}
+
+	void build(ModuleWidget* mw) {
+		this->mw = mw;
+		inputs.clear();
+		outputs.clear();
+		for (PortWidget* p : mw->getInputs()) {
+			inputs.push_back(Port{p->type, p->portId, string::f("portId: %i %s", p->portId, portName(p).c_str())});
+		}
+		for (PortWidget* p : mw->getOutputs()) {
+			outputs.push_back(Port{p->type, p->portId, string::f("portId: %i %s", p->portId, portName(p).c_str())});
+		}
+	}
+};
+
+
 struct DebugTextField : LedDisplayTextField {
 	T7AssistantModule* module;
-	int64_t lastModuleId;
-	int lastPortType;
-	int lastPortId;
+	int64_t lastModuleId = -1;
+	int lastPortType = -1;
+	int lastPortId = -1;
+	/** Selection of the last rendered text */
+	Widget* lastWidget = NULL;
+	ModuleWidget* lastModuleWidget = NULL;
+	/** Port descriptions keyed by moduleId */
+	std::unordered_map<int64_t, PortDescription> cache;
 
 	void step() override {
 		LedDisplayTextField::step();
 		if (!module) return;
 
-		lastModuleId = -1;
-		lastPortType = -1;
-		lastPortId = -1;
-
 		Widget* w = APP->event->getSelectedWidget();
-		if (!w) return;
-		ModuleWidget* mw = w->getAncestorOfType<ModuleWidget>();
-		if (!mw) return;
-		Module* m = mw->module;
-		if (!m || m == module) return;
+		ModuleWidget* mw = w ? w->getAncestorOfType<ModuleWidget>() : NULL;
+		Module* m = mw ? mw->module : NULL;
+		if (!m || m == module) {
+			lastModuleId = -1;
+			lastPortType = -1;
+			lastPortId = -1;
+			lastWidget = NULL;
+			lastModuleWidget = NULL;
+			return;
+		}
+		// Nothing to render as long as the selection does not change
+		if (w == lastWidget && mw == lastModuleWidget && m->id == lastModuleId) return;
+		// Descriptions of modules which have been removed from the rack are dropped
+		for (auto it = cache.begin(); it != cache.end();) {
+			if (!APP->engine->getModule(it->first)) it = cache.erase(it);
+			else it++;
+		}
+		lastWidget = w;
+		lastModuleWidget = mw;
 		lastModuleId = m->id;
+		lastPortType = -1;
+		lastPortId = -1;
 
 		PortWidget* pw = dynamic_cast<PortWidget*>(w);
 		if (pw) {
@@ -52,18 +100,22 @@ struct DebugTextField : LedDisplayTextField {
 			lastPortId = pw->portId;
 		}
 
+		PortDescription& pd = cache[lastModuleId];
+		// A different widget with the same id means the module has been replaced
+		if (pd.mw != mw) pd.build(mw);
+
 		std::string t = "";
-		t += string::f("moduleId:\n%lli\n", lastModuleId);
+		t += string::f("moduleId:\n%lli\n", (long long)lastModuleId);
 		t += "input ports:\n";
-		for (PortWidget* p : mw->getInputs()) {
-			t += string::f("portId: %i", p->portId);
-			if (p->portId == lastPortId && p->type == lastPortType) t += " clicked";
+		for (const PortDescription::Port& p : pd.inputs) {
+			t += p.text;
+			if (p.portId == lastPortId && p.portType == lastPortType) t += " clicked";
 			t += "\n";
 		}
 		t += "output ports:\n";
-		for (PortWidget* p : mw->getOutputs()) {
-			t += string::f("portId: %i", p->portId);
-			if (p->portId == lastPortId && p->type == lastPortType) t += " clicked";
+		for (const PortDescription::Port& p : pd.outputs) {
+			t += p.text;
+			if (p.portId == lastPortId && p.portType == lastPortType) t += " clicked";
 			t += "\n";
 		}
 
@@ -98,6 +150,79 @@ struct T7AssistantWidget : ModuleWidget {
 		debugDisplay->box.size = Vec(150.4f, 277.5f);
 		addChild(debugDisplay);
 	}
+
+	void appendContextMenu(Menu* menu) override {
+		struct TemplateItem : MenuItem {
+			T7AssistantWidget* mw;
+			void onAction(const event::Action& e) override {
+				mw->copyMappingTemplate();
+			}
+		};
+
+		menu->addChild(new MenuSeparator());
+		menu->addChild(construct<TemplateItem>(&MenuItem::text, "Copy rack as T7 mapping template", &TemplateItem::mw, this));
+	}
+
+	/**
+	 * Copies a mapping for T7-CTRL with an entry for every port of the rack, each on its own
+	 * channel and CC, to the clipboard. Ports beyond the last T7-MIDI of a chain are left out.
+	 */
+	void copyMappingTemplate() {
+		json_t* eventsJ = json_array();
+		int n = 0;
+		int skipped = 0;
+		auto addPort = [&](ModuleWidget* mw, PortWidget* pw) {
+			if (n >= T7MidiChain::MAX_LENGTH * 16 * 128) {
+				skipped++;
+				return;
+			}
+			json_t* eventJ = json_object();
+			json_object_set_new(eventJ, "type", json_string("cable"));
+			json_t* midiJ = json_object();
+			json_object_set_new(midiJ, "channel", json_integer((n / 128) % 16 + 1));
+			json_object_set_new(midiJ, "cc", json_integer(n % 128));
+			json_object_set_new(midiJ, "ccValue", json_integer(127));
+			// More ports than channels and CCs of one controller go to the next T7-MIDI
+			if (n >= 16 * 128) json_object_set_new(midiJ, "device", json_integer(n / (16 * 128) + 1));
+			json_object_set_new(eventJ, "midi", midiJ);
+			json_t* targetJ = json_object();
+			json_object_set_new(targetJ, "moduleId", json_integer(mw->module->id));
+			json_object_set_new(targetJ, "portType", json_string(pw->type == engine::Port::OUTPUT ? "output" : "input"));
+			json_object_set_new(targetJ, "portId", json_integer(pw->portId));
+			json_object_set_new(eventJ, "target", targetJ);
+			std::string comment = mw->model->name + " " + PortDescription::portName(pw);
+			json_object_set_new(eventJ, "comment", json_string(comment.c_str()));
+			json_array_append_new(eventsJ, eventJ);
+			n++;
+		};
+
+		for (Widget* w : APP->scene->rack->getModuleContainer()->children) {
+			ModuleWidget* mw = dynamic_cast<ModuleWidget*>(w);
+			if (!mw || !mw->module) continue;
+			if (mw->model == modelT7Ctrl || mw->model == modelT7Midi || mw->model == modelT7Assistant) continue;
+			for (PortWidget* pw : mw->getOutputs()) addPort(mw, pw);
+			for (PortWidget* pw : mw->getInputs()) addPort(mw, pw);
+		}
+
+		json_t* driverJ = json_object();
+		json_object_set_new(driverJ, "driverName", json_string("MidiCcTwoMessageToggle"));
+		json_object_set_new(driverJ, "events", eventsJ);
+		json_t* driversJ = json_array();
+		json_array_append_new(driversJ, driverJ);
+		DEFER({
+			json_decref(driversJ);
+		});
+		char* mappingJson = json_dumps(driversJ, JSON_INDENT(2) | JSON_REAL_PRECISION(9));
+		DEFER({
+			free(mappingJson);
+		});
+		glfwSetClipboardString(APP->window->win, mappingJson);
+
+		if (skipped > 0) {
+			std::string message = string::f("%i ports do not fit into a chain of %i T7-MIDI and have been left out of the template.", skipped, T7MidiChain::MAX_LENGTH);
+			osdialog_message(OSDIALOG_WARNING, OSDIALOG_OK, message.c_str());
+		}
+	}
 };
 
 } // namespace T7
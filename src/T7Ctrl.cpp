@@ -5,27 +5,169 @@
 
 namespace T7 {
 
+/**
+ * Maps MIDI messages with a channel and a number to ports, an output and an input
+ * result in a cable event. Derived drivers reuse the tables for notes, program
+ * changes and NRPNs.
+ */
 template < typename MODULE >
 struct MidiCcTwoMessage : T7Driver {
 	struct MidiPortDescriptor : PortDescriptor {
+		int midiDevice = 0; // 0 = any, see T7MidiChain::MAX_DEVICES
+		int midiChannel; // -1 = omni
+		int midiCc; // CC, note, program or NRPN parameter, depending on the driver
 		int midiCcValue;
-		std::string cableColor = "";
-		std::string comment = "";
+		/** Parsed when the mapping is loaded, only valid if hasCableColor is set */
+		NVGcolor cableColor;
+		bool hasCableColor = false;
+	};
+
+	/** Compiled mapping, immutable once published */
+	struct Mapping {
+		/** All mapped ports, stored contiguously */
+		std::vector<MidiPortDescriptor> descriptors;
+		/** Comments of the descriptors with the same index, not needed while processing MIDI */
+		std::vector<std::string> comments;
+		/**
+		 * Index into descriptors for each device, channel and CC, -1 if unmapped.
+		 * Row 0 holds omni mappings, rows 1..16 MIDI channels 1..16 which fall back to omni.
+		 * Device 0 holds mappings of any device, devices 1.. fall back to device 0.
+		 */
+		int16_t ccTable[T7MidiChain::MAX_DEVICES][17][128];
+		/** Index into descriptors by device, channel and parameter, MidiNrpnTwoMessageToggle only */
+		std::unordered_map<int, int16_t> nrpnTable;
 	};
 
+	/** Descriptors are indexed by int16_t in the ccTable and the nrpnTable */
+	static const int MAX_DESCRIPTORS = 32767;
+
 	MODULE* module;
 
-	std::map<std::tuple<int, int>, const MidiPortDescriptor*> portMap;
-	const MidiPortDescriptor* lastInput = NULL;
-	const MidiPortDescriptor* lastOutput = NULL;
+	/** The UI thread builds and reads mapping.latest, the engine thread reads mapping.get() */
+	T7Exchange<Mapping> mapping;
+	/** Copies, the mapping may be replaced between the two messages of an event */
+	MidiPortDescriptor lastInput;
+	MidiPortDescriptor lastOutput;
+	bool hasLastInput = false;
+	bool hasLastOutput = false;
 	int lastEventType; // 0 = Trigger, 1 = Add, 2 = Remove
 
-	~MidiCcTwoMessage() {
-		for (auto p : portMap) {
-			delete p.second;
+	MidiCcTwoMessage() {
+		buildTable(*mapping.latest);
+	}
+
+	/** JSON keys of the number and the value threshold of a mapping, valueKey() is NULL if there is no value */
+	virtual const char* numberKey() { return "cc"; }
+	virtual const char* valueKey() { return "ccValue"; }
+	virtual int maxNumber() { return 127; }
+
+	uint16_t getStatusMask() override {
+		return 1 << 0xb;
+	}
+
+	bool isMapped(int device, uint8_t status, uint8_t channel, uint8_t number) override {
+		return mapping.latest->ccTable[device][channel + 1][number] >= 0;
+	}
+
+	/** Builds the lookup tables of m from its descriptors */
+	virtual void buildTable(Mapping& m) {
+		for (int d = 0; d < T7MidiChain::MAX_DEVICES; d++) {
+			for (int i = 0; i < 17; i++) {
+				for (int j = 0; j < 128; j++) {
+					m.ccTable[d][i][j] = -1;
+				}
+			}
+		}
+		for (size_t i = 0; i < m.descriptors.size(); i++) {
+			const MidiPortDescriptor& pd = m.descriptors[i];
+			m.ccTable[pd.midiDevice][pd.midiChannel + 1][pd.midiCc] = i;
+		}
+		// Lookup order: device and channel, device and omni, any device and channel, any device and omni
+		for (int d = 0; d < T7MidiChain::MAX_DEVICES; d++) {
+			for (int i = 1; i < 17; i++) {
+				for (int j = 0; j < 128; j++) {
+					if (m.ccTable[d][i][j] < 0) m.ccTable[d][i][j] = m.ccTable[d][0][j];
+				}
+			}
+		}
+		for (int d = 1; d < T7MidiChain::MAX_DEVICES; d++) {
+			for (int i = 0; i < 17; i++) {
+				for (int j = 0; j < 128; j++) {
+					if (m.ccTable[d][i][j] < 0) m.ccTable[d][i][j] = m.ccTable[0][i][j];
+				}
+			}
 		}
 	}
 
+	/** Adds or replaces the mapping of the device, channel and number of pd, UI thread only */
+	void learn(const MidiPortDescriptor& pd, std::string comment) {
+		// The published mapping may be in use by the engine thread, learn into a copy
+		Mapping* m = new Mapping(*mapping.latest);
+		bool found = false;
+		for (size_t i = 0; i < m->descriptors.size(); i++) {
+			MidiPortDescriptor& d = m->descriptors[i];
+			if (d.midiDevice == pd.midiDevice && d.midiChannel == pd.midiChannel && d.midiCc == pd.midiCc) {
+				d = pd;
+				m->comments[i] = comment;
+				found = true;
+			}
+		}
+		if (!found) {
+			if ((int)m->descriptors.size() >= MAX_DESCRIPTORS) {
+				delete m;
+				return;
+			}
+			m->descriptors.push_back(pd);
+			m->comments.push_back(comment);
+		}
+		buildTable(*m);
+		mapping.publish(m);
+	}
+
+	/** Engine thread */
+	const MidiPortDescriptor* findDescriptor(int device, uint8_t ch, uint8_t cc) {
+		const Mapping* m = mapping.get();
+		int16_t i = m->ccTable[device][(ch & 0x0f) + 1][cc & 0x7f];
+		return i >= 0 ? &m->descriptors[i] : NULL;
+	}
+
+	/** Keeps pd as output or input of the next event */
+	void setLast(const MidiPortDescriptor* pd) {
+		if (pd->portType == 0) {
+			lastOutput = *pd;
+			hasLastOutput = true;
+		}
+		if (pd->portType == 1) {
+			lastInput = *pd;
+			hasLastInput = true;
+		}
+	}
+
+	bool hasPair() {
+		return hasLastInput && hasLastOutput;
+	}
+
+	/** An output triggers a toggle, values below the threshold are ignored */
+	bool toggle(const MidiPortDescriptor* pd, int value) {
+		if (pd) {
+			if (value >= pd->midiCcValue) {
+				if (pd->portType == 0) lastEventType = 0; // Toggle
+				setLast(pd);
+			}
+		}
+		return hasPair();
+	}
+
+	/** Value 0 removes, values from the threshold on add */
+	bool gate(const MidiPortDescriptor* pd, int value) {
+		if (pd) {
+			if (value == 0) lastEventType = 2; // Remove
+			if (value >= pd->midiCcValue) lastEventType = 1; // Add
+			setLast(pd);
+		}
+		return hasPair();
+	}
+
 	void exampleJson(json_t* driverJ) override {
 		json_t* eventsJ = json_array();
 
@@ -35,8 +177,8 @@ struct MidiCcTwoMessage : T7Driver {
 
 		json_t* midiJ = json_object();
 		json_object_set_new(midiJ, "channel", json_integer(0));
-		json_object_set_new(midiJ, "cc", json_integer(11));
-		json_object_set_new(midiJ, "ccValue", json_integer(127));
+		json_object_set_new(midiJ, numberKey(), json_integer(11));
+		if (valueKey()) json_object_set_new(midiJ, valueKey(), json_integer(127));
 		json_object_set_new(eventJ, "midi", midiJ);
 
 		json_t* targetJ = json_object();
@@ -55,8 +197,8 @@ struct MidiCcTwoMessage : T7Driver {
 
 		midiJ = json_object();
 		json_object_set_new(midiJ, "channel", json_integer(0));
-		json_object_set_new(midiJ, "cc", json_integer(12));
-		json_object_set_new(midiJ, "ccValue", json_integer(127));
+		json_object_set_new(midiJ, numberKey(), json_integer(12));
+		if (valueKey()) json_object_set_new(midiJ, valueKey(), json_integer(127));
 		json_object_set_new(eventJ, "midi", midiJ);
 
 		targetJ = json_object();
@@ -75,8 +217,8 @@ struct MidiCcTwoMessage : T7Driver {
 
 		midiJ = json_object();
 		json_object_set_new(midiJ, "channel", json_integer(1));
-		json_object_set_new(midiJ, "cc", json_integer(13));
-		json_object_set_new(midiJ, "ccValue", json_integer(127));
+		json_object_set_new(midiJ, numberKey(), json_integer(13));
+		if (valueKey()) json_object_set_new(midiJ, valueKey(), json_integer(127));
 		json_object_set_new(eventJ, "midi", midiJ);
 
 		targetJ = json_object();
@@ -94,8 +236,8 @@ struct MidiCcTwoMessage : T7Driver {
 
 		midiJ = json_object();
 		json_object_set_new(midiJ, "channel", json_integer(1));
-		json_object_set_new(midiJ, "cc", json_integer(13));
-		json_object_set_new(midiJ, "ccValue", json_integer(127));
+		json_object_set_new(midiJ, numberKey(), json_integer(13));
+		if (valueKey()) json_object_set_new(midiJ, valueKey(), json_integer(127));
 		json_object_set_new(eventJ, "midi", midiJ);
 
 		targetJ = json_object();
@@ -111,89 +253,146 @@ struct MidiCcTwoMessage : T7Driver {
 	}
 
 	void toJson(json_t* driverJ) override {
+		const Mapping& m = *mapping.latest;
 		json_t* eventsJ = json_array();
-		for (auto p : portMap) {
+		for (size_t i = 0; i < m.descriptors.size(); i++) {
+			const MidiPortDescriptor& pd = m.descriptors[i];
 			json_t* eventJ = json_object();
 			json_object_set_new(eventJ, "type", json_string("cable"));
 
 			json_t* midiJ = json_object();
-			json_object_set_new(midiJ, "channel", json_integer(std::get<0>(p.first) + 1));
-			json_object_set_new(midiJ, "cc", json_integer(std::get<1>(p.first)));
-			json_object_set_new(midiJ, "ccValue", json_integer(p.second->midiCcValue));
+			if (pd.midiDevice > 0) json_object_set_new(midiJ, "device", json_integer(pd.midiDevice));
+			json_object_set_new(midiJ, "channel", json_integer(pd.midiChannel + 1));
+			json_object_set_new(midiJ, numberKey(), json_integer(pd.midiCc));
+			if (valueKey()) json_object_set_new(midiJ, valueKey(), json_integer(pd.midiCcValue));
 			json_object_set_new(eventJ, "midi", midiJ);
 
 			json_t* targetJ = json_object();
-			json_object_set_new(targetJ, "moduleId", json_integer(p.second->moduleId));
-			json_object_set_new(targetJ, "portType", json_string(p.second->portType == 0 ? "output" : "input"));
-			json_object_set_new(targetJ, "portId", json_integer(p.second->portId));
+			json_object_set_new(targetJ, "moduleId", json_integer(pd.moduleId));
+			json_object_set_new(targetJ, "portType", json_string(pd.portType == 0 ? "output" : "input"));
+			json_object_set_new(targetJ, "portId", json_integer(pd.portId));
 			json_object_set_new(eventJ, "target", targetJ);
 
-			if (p.second->portType == 0) json_object_set_new(eventJ, "cableColor", json_string(p.second->cableColor.c_str()));
-			json_object_set_new(eventJ, "comment", json_string(p.second->comment.c_str()));
+			if (pd.hasCableColor) json_object_set_new(eventJ, "cableColor", json_string(color::toHexString(pd.cableColor).c_str()));
+			json_object_set_new(eventJ, "comment", json_string(m.comments[i].c_str()));
 			json_array_append_new(eventsJ, eventJ);
 		}
 		json_object_set_new(driverJ, "events", eventsJ);
 	}
 
-	void fromJson(json_t* driverJ) override {
-		reset();
+	/** Validates one entry of the JSON mapping, returns an empty string if it is valid */
+	std::string compileEntry(json_t* eventJ, MidiPortDescriptor& pd, std::string& comment) {
+		json_t* typeJ = json_object_get(eventJ, "type");
+		if (!json_is_string(typeJ)) return "missing type";
+		if (std::string(json_string_value(typeJ)) != "cable") return string::f("unknown type \"%s\"", json_string_value(typeJ));
+
+		json_t* midiJ = json_object_get(eventJ, "midi");
+		if (!json_is_object(midiJ)) return "missing midi";
+		json_t* midiDeviceJ = json_object_get(midiJ, "device");
+		json_t* midiChannelJ = json_object_get(midiJ, "channel");
+		json_t* midiCcJ = json_object_get(midiJ, numberKey());
+		json_t* midiCcValueJ = valueKey() ? json_object_get(midiJ, valueKey()) : NULL;
+		if (!json_is_integer(midiChannelJ)) return "missing midi channel";
+		if (!json_is_integer(midiCcJ)) return string::f("missing midi %s", numberKey());
+
+		json_t* targetJ = json_object_get(eventJ, "target");
+		if (!json_is_object(targetJ)) return "missing target";
+		json_t* moduleIdJ = json_object_get(targetJ, "moduleId");
+		json_t* portTypeJ = json_object_get(targetJ, "portType");
+		json_t* portIdJ = json_object_get(targetJ, "portId");
+		if (!json_is_integer(moduleIdJ)) return "missing target moduleId";
+		if (!json_is_string(portTypeJ)) return "missing target portType";
+		if (!json_is_integer(portIdJ)) return "missing target portId";
+
+		pd.midiDevice = json_integer_value(midiDeviceJ);
+		pd.midiChannel = json_integer_value(midiChannelJ) - 1;
+		pd.midiCc = json_integer_value(midiCcJ);
+		if (pd.midiDevice < 0 || pd.midiDevice >= T7MidiChain::MAX_DEVICES) return string::f("midi device %i out of range 0..%i", pd.midiDevice, T7MidiChain::MAX_DEVICES - 1);
+		pd.midiCcValue = json_integer_value(midiCcValueJ);
+		if (pd.midiChannel < -1 || pd.midiChannel > 15) return string::f("midi channel %i out of range 0..16", pd.midiChannel + 1);
+		if (pd.midiCc < 0 || pd.midiCc > maxNumber()) return string::f("midi %s %i out of range 0..%i", numberKey(), pd.midiCc, maxNumber());
+		if (pd.midiCcValue < 0 || pd.midiCcValue > 127) return string::f("midi %s %i out of range 0..127", valueKey(), pd.midiCcValue);
+
+		std::string portType = json_string_value(portTypeJ);
+		if (portType == "output") pd.portType = 0;
+		else if (portType == "input") pd.portType = 1;
+		else return string::f("unknown portType \"%s\"", portType.c_str());
+		pd.moduleId = json_integer_value(moduleIdJ);
+		pd.portId = json_integer_value(portIdJ);
+		if (pd.moduleId < 0) return "negative moduleId";
+		if (pd.portId < 0) return "negative portId";
+
+		json_t* cableColorJ = json_object_get(eventJ, "cableColor");
+		json_t* commentJ = json_object_get(eventJ, "comment");
+		std::string cableColor = json_is_string(cableColorJ) ? json_string_value(cableColorJ) : "";
+		comment = json_is_string(commentJ) ? json_string_value(commentJ) : "";
+		if (cableColor != "" && cableColor[0] != '#') return string::f("invalid cableColor \"%s\"", cableColor.c_str());
+		pd.hasCableColor = cableColor != "";
+		if (pd.hasCableColor) pd.cableColor = color::fromHexString(cableColor);
+		return "";
+	}
+
+	void fromJson(json_t* driverJ, std::vector<std::string>& errors) override {
+		Mapping* m = new Mapping;
 		json_t* eventsJ = json_object_get(driverJ, "events");
 		if (eventsJ) {
+			m->descriptors.reserve(json_array_size(eventsJ));
+			m->comments.reserve(json_array_size(eventsJ));
+			// Index into descriptors by device, channel and number
+			std::unordered_map<int, size_t> mapped;
 			json_t* eventJ;
 			size_t eventIdx;
 			json_array_foreach(eventsJ, eventIdx, eventJ) {
-				json_t* typeJ = json_object_get(eventJ, "type");
-				if (std::string(json_string_value(typeJ)) != "cable") continue;
-
-				json_t* midiJ = json_object_get(eventJ, "midi");
-				if (!midiJ) continue;
-				json_t* midiChannelJ = json_object_get(midiJ, "channel");
-				json_t* midiCcJ = json_object_get(midiJ, "cc");
-				json_t* midiCcValueJ = json_object_get(midiJ, "ccValue");
-
-				json_t* targetJ = json_object_get(eventJ, "target");
-				if (!targetJ) continue;
-				json_t* moduleIdJ = json_object_get(targetJ, "moduleId");
-				json_t* portTypeJ = json_object_get(targetJ, "portType");
-				json_t* portIdJ = json_object_get(targetJ, "portId");
-
-				if (!midiChannelJ || !midiCcJ || !moduleIdJ || !portTypeJ || !portIdJ) continue;
-				json_t* cableColorJ = json_object_get(eventJ, "cableColor");
-				json_t* commentJ = json_object_get(eventJ, "comment");
-
-				int midiChannel = json_integer_value(midiChannelJ) - 1;
-				int midiCc = json_integer_value(midiCcJ);
-
-				MidiPortDescriptor* pd = new MidiPortDescriptor;
-				pd->midiCcValue = json_integer_value(midiCcValueJ);
-				pd->moduleId = json_integer_value(moduleIdJ);
-				pd->portType = std::string(json_string_value(portTypeJ)) == "output" ? 0 : 1;
-				pd->portId = json_integer_value(portIdJ);
-				pd->cableColor = cableColorJ ? json_string_value(cableColorJ) : "";
-				pd->comment = commentJ ? json_string_value(commentJ) : "";
+				MidiPortDescriptor pd;
+				std::string comment;
+				std::string error = compileEntry(eventJ, pd, comment);
+				if (error != "") {
+					errors.push_back(string::f("%s entry %i: %s", getName().c_str(), (int)eventIdx + 1, error.c_str()));
+					continue;
+				}
 
-				auto t = std::make_tuple(midiChannel, midiCc);
-				portMap[t] = pd;
+				// A later mapping of the same channel and number replaces the earlier one
+				int key = (pd.midiDevice << 19) | ((pd.midiChannel + 1) << 14) | pd.midiCc;
+				auto it = mapped.find(key);
+				if (it != mapped.end()) {
+					m->descriptors[it->second] = pd;
+					m->comments[it->second] = comment;
+				}
+				else {
+					if ((int)m->descriptors.size() >= MAX_DESCRIPTORS) {
+						errors.push_back(string::f("%s entry %i: more than %i mappings", getName().c_str(), (int)eventIdx + 1, MAX_DESCRIPTORS));
+						continue;
+					}
+					mapped[key] = m->descriptors.size();
+					m->descriptors.push_back(pd);
+					m->comments.push_back(comment);
+				}
 			}
 		}
+		buildTable(*m);
+		mapping.publish(m);
 	}
 
 	void reset() override {
-		portMap.clear();
+		Mapping* m = new Mapping;
+		buildTable(*m);
+		mapping.publish(m);
 	}
 
-	T7Event* getEvent() override {
-		if (lastInput && lastOutput) {
-			T7CableEvent* e = NULL;
-			if (lastEventType == 0) e = new T7CableToggleEvent {*lastOutput, *lastInput};
-			if (lastEventType == 1) e = new T7CableAddEvent {*lastOutput, *lastInput};
-			if (lastEventType == 2) e = new T7CableRemoveEvent {*lastOutput, *lastInput};
-			e->cableColor = lastOutput->cableColor;
+	bool getEvent(T7Event* e) override {
+		if (hasPair()) {
+			if (lastEventType == 0) e->type = T7EventType::CABLE_TOGGLE;
+			if (lastEventType == 1) e->type = T7EventType::CABLE_ADD;
+			if (lastEventType == 2) e->type = T7EventType::CABLE_REMOVE;
+			e->outPd = lastOutput;
+			e->inPd = lastInput;
+			e->cableColor = lastOutput.cableColor;
+			e->hasCableColor = lastOutput.hasCableColor;
 			e->replaceInputCable = module->replaceInputCable;
-			lastInput = lastOutput = NULL;
-			return e;
+			hasLastInput = hasLastOutput = false;
+			return true;
 		}
-		return NULL;
+		return false;
 	}
 };
 
@@ -204,58 +403,516 @@ struct MidiCcTwoMessageToggle : MidiCcTwoMessage<MODULE> {
 		return "MidiCcTwoMessageToggle";
 	}
 
-	bool processMessage(midi::Message msg) override {
-		uint8_t ch = msg.getChannel();
-		uint8_t cc = msg.getNote();
-		int8_t value = msg.bytes[2];
+	bool processMessage(int device, const midi::Message& msg) override {
+		return this->toggle(this->findDescriptor(device, msg.getChannel(), msg.getNote()), msg.getValue());
+	}
+};
+
+
+template < typename MODULE >
+struct MidiCcTwoMessageGate : MidiCcTwoMessage<MODULE> {
+	std::string getName() override {
+		return "MidiCcTwoMessageGate";
+	}
+
+	bool processMessage(int device, const midi::Message& msg) override {
+		return this->gate(this->findDescriptor(device, msg.getChannel(), msg.getNote()), msg.getValue());
+	}
+};
+
+
+template < typename MODULE >
+struct MidiNoteTwoMessageToggle : MidiCcTwoMessage<MODULE> {
+	std::string getName() override {
+		return "MidiNoteTwoMessageToggle";
+	}
+
+	const char* numberKey() override { return "note"; }
+	const char* valueKey() override { return "velocity"; }
+
+	uint16_t getStatusMask() override {
+		return (1 << 0x8) | (1 << 0x9);
+	}
 
-		auto it = this->portMap.find(std::tuple<int, int>(ch, cc));
-		if (it == this->portMap.end()) {
-			it = this->portMap.find(std::tuple<int, int>(-1, cc));
+	bool processMessage(int device, const midi::Message& msg) override {
+		// Note offs and note ons with velocity 0 do not toggle
+		if (msg.getStatus() != 0x9 || msg.getValue() == 0) return this->hasPair();
+		return this->toggle(this->findDescriptor(device, msg.getChannel(), msg.getNote()), msg.getValue());
+	}
+};
+
+
+template < typename MODULE >
+struct MidiNoteTwoMessageGate : MidiCcTwoMessage<MODULE> {
+	std::string getName() override {
+		return "MidiNoteTwoMessageGate";
+	}
+
+	const char* numberKey() override { return "note"; }
+	const char* valueKey() override { return "velocity"; }
+
+	uint16_t getStatusMask() override {
+		return (1 << 0x8) | (1 << 0x9);
+	}
+
+	bool processMessage(int device, const midi::Message& msg) override {
+		int velocity = msg.getStatus() == 0x8 ? 0 : msg.getValue();
+		return this->gate(this->findDescriptor(device, msg.getChannel(), msg.getNote()), velocity);
+	}
+};
+
+
+template < typename MODULE >
+struct MidiProgramTwoMessageToggle : MidiCcTwoMessage<MODULE> {
+	std::string getName() override {
+		return "MidiProgramTwoMessageToggle";
+	}
+
+	const char* numberKey() override { return "program"; }
+	const char* valueKey() override { return NULL; }
+
+	uint16_t getStatusMask() override {
+		return 1 << 0xc;
+	}
+
+	bool processMessage(int device, const midi::Message& msg) override {
+		return this->toggle(this->findDescriptor(device, msg.getChannel(), msg.getNote()), 127);
+	}
+};
+
+
+/**
+ * Maps 14-bit NRPN parameters (CC 99/98) to ports, the data entry MSB (CC 6) is compared
+ * with the threshold and toggles the cable.
+ */
+template < typename MODULE >
+struct MidiNrpnTwoMessageToggle : MidiCcTwoMessage<MODULE> {
+	/** Selected parameter per device and channel, 0x7f for both is the null parameter */
+	uint8_t paramMsb[T7MidiChain::MAX_DEVICES][16];
+	uint8_t paramLsb[T7MidiChain::MAX_DEVICES][16];
+
+	MidiNrpnTwoMessageToggle() {
+		resetParams();
+	}
+
+	std::string getName() override {
+		return "MidiNrpnTwoMessageToggle";
+	}
+
+	const char* numberKey() override { return "parameter"; }
+	const char* valueKey() override { return "value"; }
+	int maxNumber() override { return 16382; }
+
+	uint16_t getStatusMask() override {
+		return 1 << 0xb;
+	}
+
+	/** midiDevice 0 = any, midiChannel -1 = omni */
+	static int key(int midiDevice, int midiChannel, int parameter) {
+		return (midiDevice << 19) | ((midiChannel + 1) << 14) | parameter;
+	}
+
+	bool isMapped(int device, uint8_t status, uint8_t channel, uint8_t number) override {
+		if (this->mapping.latest->descriptors.empty()) return false;
+		return number == 99 || number == 98 || number == 101 || number == 100 || number == 6;
+	}
+
+	/** The nrpnTable is indexed by key(), parameters above 127 do not fit into the ccTable which stays empty */
+	void buildTable(typename MidiCcTwoMessage<MODULE>::Mapping& m) override {
+		std::fill(&m.ccTable[0][0][0], &m.ccTable[0][0][0] + sizeof(m.ccTable) / sizeof(m.ccTable[0][0][0]), -1);
+		m.nrpnTable.clear();
+		m.nrpnTable.reserve(m.descriptors.size());
+		for (size_t i = 0; i < m.descriptors.size(); i++) {
+			const typename MidiCcTwoMessage<MODULE>::MidiPortDescriptor& pd = m.descriptors[i];
+			m.nrpnTable[key(pd.midiDevice, pd.midiChannel, pd.midiCc)] = i;
 		}
+	}
 
-		if (it != this->portMap.end()) {
-			const typename MidiCcTwoMessage<MODULE>::MidiPortDescriptor* pd;
-			std::tie(std::ignore, pd) = *it;
+	/** Same lookup order as Mapping::ccTable, engine thread */
+	const typename MidiCcTwoMessage<MODULE>::MidiPortDescriptor* findNrpnDescriptor(int device, uint8_t ch, int parameter) {
+		const typename MidiCcTwoMessage<MODULE>::Mapping* m = this->mapping.get();
+		auto it = m->nrpnTable.find(key(device, ch, parameter));
+		if (it == m->nrpnTable.end()) it = m->nrpnTable.find(key(device, -1, parameter));
+		if (it == m->nrpnTable.end()) it = m->nrpnTable.find(key(0, ch, parameter));
+		if (it == m->nrpnTable.end()) it = m->nrpnTable.find(key(0, -1, parameter));
+		return it != m->nrpnTable.end() ? &m->descriptors[it->second] : NULL;
+	}
 
-			if (value >= pd->midiCcValue) {
-				if (pd->portType == 0) this->lastEventType = 0; // Toggle
-				if (pd->portType == 0) this->lastOutput = pd; // output
-				if (pd->portType == 1) this->lastInput = pd; // input
+	void resetParams() {
+		for (int d = 0; d < T7MidiChain::MAX_DEVICES; d++) {
+			for (int i = 0; i < 16; i++) {
+				paramMsb[d][i] = paramLsb[d][i] = 0x7f;
 			}
 		}
+	}
+
+	void reset() override {
+		MidiCcTwoMessage<MODULE>::reset();
+		resetParams();
+	}
 
-		return this->lastInput && this->lastOutput;
+	bool processMessage(int device, const midi::Message& msg) override {
+		uint8_t ch = msg.getChannel() & 0x0f;
+		uint8_t value = msg.getValue() & 0x7f;
+		switch (msg.getNote()) {
+			case 99: paramMsb[device][ch] = value; break;
+			case 98: paramLsb[device][ch] = value; break;
+			// RPN selected, following data entries do not belong to a NRPN
+			case 101:
+			case 100: paramMsb[device][ch] = paramLsb[device][ch] = 0x7f; break;
+			case 6: {
+				if (paramMsb[device][ch] == 0x7f && paramLsb[device][ch] == 0x7f) break;
+				return this->toggle(findNrpnDescriptor(device, ch, (paramMsb[device][ch] << 7) | paramLsb[device][ch]), value);
+			}
+		}
+		return this->hasPair();
 	}
 };
 
 
 template < typename MODULE >
-struct MidiCcTwoMessageGate : MidiCcTwoMessage<MODULE> {
+struct MidiScene : T7Driver {
+	struct Scene {
+		/** Stable across removals of other scenes, ids are never reused, see SceneSet::nextId */
+		int id = -1;
+		int midiType; // 0 = Program change, 1 = CC
+		int midiDevice = 0; // 0 = any
+		int midiChannel; // -1 = omni
+		int midiNumber;
+		int midiCcValue = 127;
+		std::string comment = "";
+		std::vector<T7CableDescriptor> cables;
+	};
+
+	/** Scene ids are stored as int16_t in the trigger table and in recordings */
+	static const int MAX_SCENE_ID = 32767;
+
+	struct Trigger {
+		int16_t sceneId;
+		uint8_t ccValue;
+	};
+
+	/** Scenes and their trigger table, immutable once published */
+	struct SceneSet {
+		std::vector<Scene> scenes;
+		/** Id of the next new scene, queued events and recordings refer to scenes by id */
+		int nextId = 0;
+		/** Scene for program changes (0) and CCs (1) per device, channel and number, see MidiCcTwoMessage::Mapping::ccTable */
+		Trigger triggerTable[2][T7MidiChain::MAX_DEVICES][17][128];
+	};
+
+	MODULE* module;
+
+	/** The UI thread builds and reads sceneSet.latest, the engine thread reads sceneSet.get() */
+	T7Exchange<SceneSet> sceneSet;
+	int lastSceneId = -1;
+
+	MidiScene() {
+		buildTriggerTable(*sceneSet.latest);
+	}
+
 	std::string getName() override {
-		return "MidiCcTwoMessageGate";
+		return "MidiScene";
+	}
+
+	uint16_t getStatusMask() override {
+		return (1 << 0xb) | (1 << 0xc);
+	}
+
+	bool isMapped(int device, uint8_t status, uint8_t channel, uint8_t number) override {
+		return sceneSet.latest->triggerTable[status == 0xc ? 0 : 1][device][channel + 1][number].sceneId >= 0;
+	}
+
+	void buildTriggerTable(SceneSet& s) {
+		for (int t = 0; t < 2; t++) {
+			for (int d = 0; d < T7MidiChain::MAX_DEVICES; d++) {
+				for (int i = 0; i < 17; i++) {
+					for (int j = 0; j < 128; j++) {
+						s.triggerTable[t][d][i][j].sceneId = -1;
+						s.triggerTable[t][d][i][j].ccValue = 0;
+					}
+				}
+			}
+		}
+		for (size_t i = 0; i < s.scenes.size(); i++) {
+			const Scene& scene = s.scenes[i];
+			Trigger& tr = s.triggerTable[scene.midiType][scene.midiDevice][scene.midiChannel + 1][scene.midiNumber];
+			tr.sceneId = scene.id;
+			tr.ccValue = scene.midiCcValue;
+		}
+		for (int t = 0; t < 2; t++) {
+			for (int d = 0; d < T7MidiChain::MAX_DEVICES; d++) {
+				for (int i = 1; i < 17; i++) {
+					for (int j = 0; j < 128; j++) {
+						if (s.triggerTable[t][d][i][j].sceneId < 0) s.triggerTable[t][d][i][j] = s.triggerTable[t][d][0][j];
+					}
+				}
+			}
+			for (int d = 1; d < T7MidiChain::MAX_DEVICES; d++) {
+				for (int i = 0; i < 17; i++) {
+					for (int j = 0; j < 128; j++) {
+						if (s.triggerTable[t][d][i][j].sceneId < 0) s.triggerTable[t][d][i][j] = s.triggerTable[t][0][i][j];
+					}
+				}
+			}
+		}
 	}
 
-	bool processMessage(midi::Message msg) override {
-		uint8_t ch = msg.getChannel();
-		uint8_t cc = msg.getNote();
-		int8_t value = msg.bytes[2];
+	/** Index of the scene with id in s, -1 if there is none */
+	int findSceneById(const SceneSet& s, int id) {
+		for (size_t i = 0; i < s.scenes.size(); i++) {
+			if (s.scenes[i].id == id) return i;
+		}
+		return -1;
+	}
 
-		auto it = this->portMap.find(std::tuple<int, int>(ch, cc));
-		if (it == this->portMap.end()) {
-			it = this->portMap.find(std::tuple<int, int>(-1, cc));
+	int findScene(const SceneSet& s, int midiType, int midiDevice, int midiChannel, int midiNumber) {
+		for (size_t i = 0; i < s.scenes.size(); i++) {
+			const Scene& scene = s.scenes[i];
+			if (scene.midiType == midiType && scene.midiDevice == midiDevice && scene.midiChannel == midiChannel && scene.midiNumber == midiNumber) return i;
 		}
+		return -1;
+	}
 
-		if (it != this->portMap.end()) {
-			const typename MidiCcTwoMessage<MODULE>::MidiPortDescriptor* pd;
-			std::tie(std::ignore, pd) = *it;
-			if (value == 0) this->lastEventType = 2; // Remove
-			if (value >= pd->midiCcValue) this->lastEventType = 1; // Add
-			if (pd->portType == 0) this->lastOutput = pd; // output
-			if (pd->portType == 1) this->lastInput = pd; // input
+	/** Stores all cables of the rack as scene for the MIDI message, UI thread only */
+	void captureScene(int midiType, int midiDevice, int midiChannel, int midiNumber) {
+		SceneSet* s = new SceneSet(*sceneSet.latest);
+		int i = findScene(*s, midiType, midiDevice, midiChannel, midiNumber);
+		if (i < 0) {
+			if (s->nextId > MAX_SCENE_ID) {
+				delete s;
+				return;
+			}
+			i = s->scenes.size();
+			Scene scene;
+			scene.id = s->nextId++;
+			scene.midiType = midiType;
+			scene.midiDevice = midiDevice;
+			scene.midiChannel = midiChannel;
+			scene.midiNumber = midiNumber;
+			s->scenes.push_back(scene);
 		}
 
-		return this->lastInput && this->lastOutput;
+		std::vector<T7CableDescriptor>& cables = s->scenes[i].cables;
+		cables.clear();
+		for (Widget* w : APP->scene->rack->getCableContainer()->children) {
+			CableWidget* cw = dynamic_cast<CableWidget*>(w);
+			if (!cw || !cw->isComplete()) continue;
+			T7CableDescriptor c;
+			c.outModuleId = cw->outputPort->module->id;
+			c.outPortId = cw->outputPort->portId;
+			c.inModuleId = cw->inputPort->module->id;
+			c.inPortId = cw->inputPort->portId;
+			c.color = cw->color;
+			cables.push_back(c);
+		}
+		buildTriggerTable(*s);
+		sceneSet.publish(s);
+	}
+
+	void removeScene(int sceneId) {
+		int i = findSceneById(*sceneSet.latest, sceneId);
+		if (i < 0) return;
+		SceneSet* s = new SceneSet(*sceneSet.latest);
+		s->scenes.erase(s->scenes.begin() + i);
+		buildTriggerTable(*s);
+		sceneSet.publish(s);
+	}
+
+	void exampleJson(json_t* driverJ) override {
+		json_t* scenesJ = json_array();
+
+		json_t* sceneJ = json_object();
+		json_t* midiJ = json_object();
+		json_object_set_new(midiJ, "type", json_string("program"));
+		json_object_set_new(midiJ, "channel", json_integer(0));
+		json_object_set_new(midiJ, "number", json_integer(1));
+		json_object_set_new(sceneJ, "midi", midiJ);
+
+		json_t* cablesJ = json_array();
+		json_t* cableJ = json_object();
+		json_object_set_new(cableJ, "outputModuleId", json_integer(4));
+		json_object_set_new(cableJ, "outputId", json_integer(5));
+		json_object_set_new(cableJ, "inputModuleId", json_integer(2));
+		json_object_set_new(cableJ, "inputId", json_integer(3));
+		json_object_set_new(cableJ, "color", json_string(color::toHexString(color::YELLOW).c_str()));
+		json_array_append_new(cablesJ, cableJ);
+		json_object_set_new(sceneJ, "cables", cablesJ);
+
+		json_object_set_new(sceneJ, "comment", json_string("program change 2 on any channel replaces all cables by the cables of this scene"));
+		json_array_append_new(scenesJ, sceneJ);
+
+		sceneJ = json_object();
+		midiJ = json_object();
+		json_object_set_new(midiJ, "type", json_string("cc"));
+		json_object_set_new(midiJ, "channel", json_integer(1));
+		json_object_set_new(midiJ, "number", json_integer(20));
+		json_object_set_new(midiJ, "ccValue", json_integer(127));
+		json_object_set_new(sceneJ, "midi", midiJ);
+		json_object_set_new(sceneJ, "cables", json_array());
+		json_object_set_new(sceneJ, "comment", json_string("cc 20 on channel 1 removes all cables"));
+		json_array_append_new(scenesJ, sceneJ);
+
+		json_object_set_new(driverJ, "scenes", scenesJ);
+	}
+
+	void toJson(json_t* driverJ) override {
+		json_t* scenesJ = json_array();
+		for (const Scene& scene : sceneSet.latest->scenes) {
+			json_t* sceneJ = json_object();
+			json_object_set_new(sceneJ, "id", json_integer(scene.id));
+			json_t* midiJ = json_object();
+			json_object_set_new(midiJ, "type", json_string(scene.midiType == 0 ? "program" : "cc"));
+			if (scene.midiDevice > 0) json_object_set_new(midiJ, "device", json_integer(scene.midiDevice));
+			json_object_set_new(midiJ, "channel", json_integer(scene.midiChannel + 1));
+			json_object_set_new(midiJ, "number", json_integer(scene.midiNumber));
+			if (scene.midiType == 1) json_object_set_new(midiJ, "ccValue", json_integer(scene.midiCcValue));
+			json_object_set_new(sceneJ, "midi", midiJ);
+
+			json_t* cablesJ = json_array();
+			for (const T7CableDescriptor& c : scene.cables) {
+				json_t* cableJ = json_object();
+				json_object_set_new(cableJ, "outputModuleId", json_integer(c.outModuleId));
+				json_object_set_new(cableJ, "outputId", json_integer(c.outPortId));
+				json_object_set_new(cableJ, "inputModuleId", json_integer(c.inModuleId));
+				json_object_set_new(cableJ, "inputId", json_integer(c.inPortId));
+				json_object_set_new(cableJ, "color", json_string(color::toHexString(c.color).c_str()));
+				json_array_append_new(cablesJ, cableJ);
+			}
+			json_object_set_new(sceneJ, "cables", cablesJ);
+
+			json_object_set_new(sceneJ, "comment", json_string(scene.comment.c_str()));
+			json_array_append_new(scenesJ, sceneJ);
+		}
+		json_object_set_new(driverJ, "scenes", scenesJ);
+	}
+
+	void fromJson(json_t* driverJ, std::vector<std::string>& errors) override {
+		SceneSet* s = new SceneSet;
+		json_t* scenesJ = json_object_get(driverJ, "scenes");
+		if (scenesJ) {
+			json_t* sceneJ;
+			size_t sceneIdx;
+			json_array_foreach(scenesJ, sceneIdx, sceneJ) {
+				std::string prefix = string::f("%s scene %i", getName().c_str(), (int)sceneIdx + 1);
+				json_t* midiJ = json_object_get(sceneJ, "midi");
+				if (!json_is_object(midiJ)) {
+					errors.push_back(prefix + ": missing midi");
+					continue;
+				}
+				json_t* midiTypeJ = json_object_get(midiJ, "type");
+				json_t* midiDeviceJ = json_object_get(midiJ, "device");
+				json_t* midiChannelJ = json_object_get(midiJ, "channel");
+				json_t* midiNumberJ = json_object_get(midiJ, "number");
+				json_t* midiCcValueJ = json_object_get(midiJ, "ccValue");
+				if (!json_is_string(midiTypeJ) || !json_is_integer(midiChannelJ) || !json_is_integer(midiNumberJ)) {
+					errors.push_back(prefix + ": missing midi type, channel or number");
+					continue;
+				}
+
+				Scene scene;
+				std::string midiType = json_string_value(midiTypeJ);
+				if (midiType == "program") scene.midiType = 0;
+				else if (midiType == "cc") scene.midiType = 1;
+				else {
+					errors.push_back(prefix + string::f(": unknown midi type \"%s\"", midiType.c_str()));
+					continue;
+				}
+				scene.midiDevice = json_integer_value(midiDeviceJ);
+				scene.midiChannel = json_integer_value(midiChannelJ) - 1;
+				scene.midiNumber = json_integer_value(midiNumberJ);
+				scene.midiCcValue = midiCcValueJ ? json_integer_value(midiCcValueJ) : 127;
+				if (scene.midiDevice < 0 || scene.midiDevice >= T7MidiChain::MAX_DEVICES || scene.midiChannel < -1 || scene.midiChannel > 15 || scene.midiNumber < 0 || scene.midiNumber > 127 || scene.midiCcValue < 0 || scene.midiCcValue > 127) {
+					errors.push_back(prefix + ": midi device, channel, number or ccValue out of range");
+					continue;
+				}
+				json_t* idJ = json_object_get(sceneJ, "id");
+				if (json_is_integer(idJ) && json_integer_value(idJ) >= 0 && json_integer_value(idJ) <= MAX_SCENE_ID) scene.id = json_integer_value(idJ);
+				json_t* commentJ = json_object_get(sceneJ, "comment");
+				scene.comment = json_is_string(commentJ) ? json_string_value(commentJ) : "";
+
+				json_t* cablesJ = json_object_get(sceneJ, "cables");
+				json_t* cableJ;
+				size_t cableIdx;
+				json_array_foreach(cablesJ, cableIdx, cableJ) {
+					json_t* outModuleIdJ = json_object_get(cableJ, "outputModuleId");
+					json_t* outPortIdJ = json_object_get(cableJ, "outputId");
+					json_t* inModuleIdJ = json_object_get(cableJ, "inputModuleId");
+					json_t* inPortIdJ = json_object_get(cableJ, "inputId");
+					if (!json_is_integer(outModuleIdJ) || !json_is_integer(outPortIdJ) || !json_is_integer(inModuleIdJ) || !json_is_integer(inPortIdJ)) {
+						errors.push_back(prefix + string::f(" cable %i: missing module or port id", (int)cableIdx + 1));
+						continue;
+					}
+					json_t* colorJ = json_object_get(cableJ, "color");
+
+					T7CableDescriptor c;
+					c.outModuleId = json_integer_value(outModuleIdJ);
+					c.outPortId = json_integer_value(outPortIdJ);
+					c.inModuleId = json_integer_value(inModuleIdJ);
+					c.inPortId = json_integer_value(inPortIdJ);
+					c.color = color::fromHexString(json_is_string(colorJ) ? json_string_value(colorJ) : "#ffb437");
+					scene.cables.push_back(c);
+				}
+
+				// A later scene of the same MIDI message replaces the earlier one
+				int i = findScene(*s, scene.midiType, scene.midiDevice, scene.midiChannel, scene.midiNumber);
+				if (i >= 0) s->scenes[i] = scene;
+				else s->scenes.push_back(scene);
+			}
+		}
+		// Scenes without an id or with the id of another scene get a new one
+		for (const Scene& scene : s->scenes) {
+			s->nextId = std::max(s->nextId, scene.id + 1);
+		}
+		std::unordered_set<int> ids;
+		for (auto it = s->scenes.begin(); it != s->scenes.end();) {
+			if (it->id < 0 || !ids.insert(it->id).second) {
+				if (s->nextId > MAX_SCENE_ID) {
+					errors.push_back(string::f("%s: no scene id left", getName().c_str()));
+					it = s->scenes.erase(it);
+					continue;
+				}
+				it->id = s->nextId++;
+			}
+			it++;
+		}
+		buildTriggerTable(*s);
+		sceneSet.publish(s);
+	}
+
+	void reset() override {
+		SceneSet* s = new SceneSet;
+		buildTriggerTable(*s);
+		sceneSet.publish(s);
+	}
+
+	bool processMessage(int device, const midi::Message& msg) override {
+		int t;
+		switch (msg.getStatus()) {
+			case 0xc: t = 0; break; // program change
+			case 0xb: t = 1; break; // cc
+			default: return false;
+		}
+		const Trigger& tr = sceneSet.get()->triggerTable[t][device][(msg.getChannel() & 0x0f) + 1][msg.getNote() & 0x7f];
+		if (tr.sceneId < 0) return false;
+		if (t == 1 && msg.getValue() < tr.ccValue) return false;
+		lastSceneId = tr.sceneId;
+		return true;
+	}
+
+	bool getEvent(T7Event* e) override {
+		if (lastSceneId < 0) return false;
+		e->type = T7EventType::CABLE_SCENE;
+		e->driver = this;
+		e->sceneId = lastSceneId;
+		lastSceneId = -1;
+		return true;
+	}
+
+	const std::vector<T7CableDescriptor>* getCableScene(int sceneId) override {
+		const SceneSet& s = *sceneSet.latest;
+		int i = findSceneById(s, sceneId);
+		return i >= 0 ? &s.scenes[i].cables : NULL;
 	}
 };
 
@@ -276,10 +933,68 @@ struct T7CtrlModule : Module {
 
 	bool replaceInputCable;
 
+	static const int MAX_DRIVERS = 16;
 	std::vector<T7Driver*> driver;
+	/** Built from the mappings of all drivers, immutable once published */
+	struct Dispatch {
+		/** Bit n is set if any driver processes MIDI messages of status n */
+		uint16_t statusMask = 0;
+		/**
+		 * Drivers with a mapping for each device, MIDI status, channel and number, bit i stands
+		 * for driver[i]. Unmapped messages are rejected with a single lookup. Only statuses
+		 * 0x8..0xf are stored, indexed by the lower 3 bits.
+		 */
+		uint16_t ownerTable[T7MidiChain::MAX_LENGTH][8][16][128];
+	};
+
+	/** The UI thread builds dispatch.latest, the engine thread reads dispatch.get() */
+	T7Exchange<Dispatch> dispatch;
+
+	/** Counters for profiling mappings, written by the engine thread and read by the UI thread */
+	struct DriverStats {
+		/** Messages passed to the driver */
+		std::atomic<uint32_t> matched{0};
+		std::atomic<uint32_t> events{0};
+		/** Events which did not fit into the event queue */
+		std::atomic<uint32_t> dropped{0};
+	};
+
+	DriverStats driverStats[MAX_DRIVERS];
+	/** Received messages per MIDI status */
+	std::atomic<uint32_t> statusCount[16];
+	MidiScene<T7CtrlModule>* sceneDriver;
+	/** Targets of learned mappings */
+	MidiCcTwoMessageToggle<T7CtrlModule>* ccLearnDriver;
+	MidiNoteTwoMessageToggle<T7CtrlModule>* noteLearnDriver;
+	/** Learn mappings from MIDI messages followed by a clicked port */
+	bool learnMode = false;
+	/** Device, status, channel and number of the last CC or note on while learning, -1 if none */
+	std::atomic<int> learnMessage{-1};
+	/** Device, status, channel and number of the last CC or program change, -1 if none */
+	std::atomic<int> lastMidiMessage{-1};
+
+	/** Written by the chained T7-MIDI modules, one lane per module */
+	T7MidiChain midiChain;
+	/** Number of MIDI messages dropped by chained T7-MIDI modules because their lane was full */
+	std::atomic<uint32_t> midiOverflowCount{0};
+
+	/** Raw MIDI log, formatted on the UI thread */
+	struct MidiLogEntry {
+		int device;
+		int driverId;
+		int deviceId;
+		uint8_t status;
+		uint8_t channel;
+		uint8_t number;
+		uint8_t value;
+		int64_t frame;
+	};
 
-	dsp::RingBuffer<std::string, 256> debugMessagesEngine;
-	dsp::RingBuffer<T7Event*, 16> events;
+	T7SpscRing<MidiLogEntry, 256> debugMessagesEngine;
+	/** Event pool shared with the widget, overflowCount counts dropped events */
+	T7EventQueue events;
+	/** Receives events which do not fit into the queue */
+	T7Event eventDropped;
 
 	struct EventLogger : T7EventLogger {
 		dsp::RingBuffer<std::string, 256> debugMessagesGui;
@@ -289,17 +1004,43 @@ struct T7CtrlModule : Module {
 	};
 
 	EventLogger eventLogger;
+	/** Invalid entries of the last loaded mapping, UI thread only */
+	std::vector<std::string> mappingErrors;
+	/** Recorded cable changes, UI thread only */
+	T7Recorder recorder;
 
 	T7CtrlModule() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		onReset();
+		rightExpander.consumerMessage = &midiChain;
+		rightExpander.producerMessage = &midiChain;
 
 		auto d1 = new MidiCcTwoMessageToggle<T7CtrlModule>();
 		d1->module = this;
 		driver.push_back(d1);
+		ccLearnDriver = d1;
 		auto d2 = new MidiCcTwoMessageGate<T7CtrlModule>();
 		d2->module = this;
 		driver.push_back(d2);
+		auto d3 = new MidiNoteTwoMessageToggle<T7CtrlModule>();
+		d3->module = this;
+		driver.push_back(d3);
+		noteLearnDriver = d3;
+		auto d4 = new MidiNoteTwoMessageGate<T7CtrlModule>();
+		d4->module = this;
+		driver.push_back(d4);
+		auto d5 = new MidiProgramTwoMessageToggle<T7CtrlModule>();
+		d5->module = this;
+		driver.push_back(d5);
+		auto d6 = new MidiNrpnTwoMessageToggle<T7CtrlModule>();
+		d6->module = this;
+		driver.push_back(d6);
+		sceneDriver = new MidiScene<T7CtrlModule>();
+		sceneDriver->module = this;
+		driver.push_back(sceneDriver);
+		recorder.sceneDriver = sceneDriver;
+		buildDispatchTable();
+		resetStats();
 	}
 
 	~T7CtrlModule() {
@@ -312,46 +1053,141 @@ struct T7CtrlModule : Module {
 		for (T7Driver* d : driver) {
 			d->reset();
 		}
+		buildDispatchTable();
 		replaceInputCable = true;
 		Module::onReset();
 	}
 
 	void process(const ProcessArgs& args) override {
-		Module* mr = rightExpander.module;
-		if (mr && mr->model->plugin->slug == "Stoermelder-PackTau" && mr->model->slug == "T7Midi") {
-			std::vector<T7MidiMessage>* queue = reinterpret_cast<std::vector<T7MidiMessage>*>(mr->leftExpander.consumerMessage);
-			for (T7MidiMessage m : *queue) {
-				switch (m.type) {
+		uint32_t overflowCount = 0;
+		for (int i = 0; i < T7MidiChain::MAX_LENGTH; i++) {
+			T7MidiQueue& queue = midiChain.lanes[i];
+			T7MidiMessage* m;
+			while ((m = queue.front())) {
+				switch (m->type) {
 					case T7MessageType::MIDI: {
-						processMidi(m.driverId, m.deviceId, m.msg);
+						processMidi(i + 1, m->driverId, m->deviceId, m->msg, m->frame);
 						break;
 					}
 				}
+				queue.pop();
 			}
-			queue->clear();
+			overflowCount += queue.overflowCount.load(std::memory_order_relaxed);
 		}
+		midiOverflowCount.store(overflowCount, std::memory_order_relaxed);
 	}
 
-	void processMidi(int driverId, int deviceId, midi::Message msg) {
-		switch (msg.getStatus()) {
-			case 0xb: { // cc
-				if (!debugMessagesEngine.full()) {
-					uint8_t ch = msg.getChannel();
-					uint8_t cc = msg.getNote();
-					int8_t value = msg.bytes[2];
-					std::string s = string::f("drv %i dev %i ch %i cc %i val %i", driverId, deviceId, ch + 1, cc, value);
-					debugMessagesEngine.push(s);
+	/** Maps the MIDI message m, see learnMessage, to a port, UI thread only */
+	void learnMapping(int m, int64_t moduleId, int portType, int portId) {
+		int device = m >> 20;
+		int status = (m >> 16) & 0xf;
+		MidiCcTwoMessage<T7CtrlModule>::MidiPortDescriptor pd;
+		pd.midiDevice = device;
+		pd.midiChannel = (m >> 8) & 0xff;
+		pd.midiCc = m & 0xff;
+		pd.midiCcValue = status == 0xb ? 64 : 1;
+		pd.moduleId = moduleId;
+		pd.portType = portType;
+		pd.portId = portId;
+		if (status == 0xb) ccLearnDriver->learn(pd, "learned");
+		else noteLearnDriver->learn(pd, "learned");
+		buildDispatchTable();
+		eventLogger.log(string::f("learned in %i ch %i %s %i", device, pd.midiChannel + 1, status == 0xb ? "cc" : "note", pd.midiCc));
+	}
+
+	/** Must be called after the mapping of any driver has changed, publishes a new table, UI thread only */
+	void buildDispatchTable() {
+		Dispatch* table = new Dispatch;
+		for (T7Driver* d : driver) {
+			table->statusMask |= d->getStatusMask();
+		}
+		for (int device = 1; device <= T7MidiChain::MAX_LENGTH; device++) {
+			for (int i = 0x8; i <= 0xf; i++) {
+				for (int ch = 0; ch < 16; ch++) {
+					for (int j = 0; j < 128; j++) {
+						uint16_t mask = 0;
+						for (size_t k = 0; k < driver.size() && k < MAX_DRIVERS; k++) {
+							T7Driver* d = driver[k];
+							if ((d->getStatusMask() & (1 << i)) && d->isMapped(device, i, ch, j)) mask |= 1 << k;
+						}
+						table->ownerTable[device - 1][i & 0x7][ch][j] = mask;
+					}
 				}
-				for (T7Driver* d : driver) {
-					if (d->processMessage(msg)) {
-						T7Event* e = d->getEvent();
-						e->logger = &eventLogger;
-						if (!events.full()) events.push(e);
+			}
+		}
+		dispatch.publish(table);
+	}
+
+	void resetStats() {
+		for (int i = 0; i < MAX_DRIVERS; i++) {
+			driverStats[i].matched.store(0, std::memory_order_relaxed);
+			driverStats[i].events.store(0, std::memory_order_relaxed);
+			driverStats[i].dropped.store(0, std::memory_order_relaxed);
+		}
+		for (int i = 0; i < 16; i++) {
+			statusCount[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	/** Messages of the statuses processed by driver[i] */
+	uint32_t getSeenCount(int i) {
+		uint32_t n = 0;
+		for (int j = 0; j < 16; j++) {
+			if (driver[i]->getStatusMask() & (1 << j)) n += statusCount[j].load(std::memory_order_relaxed);
+		}
+		return n;
+	}
+
+	/** device is the position of the T7-MIDI in the chain starting at 1 */
+	void processMidi(int device, int driverId, int deviceId, const midi::Message& msg, int64_t frame) {
+		uint8_t status = msg.getStatus();
+		// Drivers process channel voice messages only, see Dispatch::ownerTable
+		if (status < 0x8 || !(dispatch.get()->statusMask & (1 << status))) return;
+		statusCount[status].fetch_add(1, std::memory_order_relaxed);
+
+		MidiLogEntry* l = debugMessagesEngine.beginPush();
+		if (l) {
+			l->device = device;
+			l->driverId = driverId;
+			l->deviceId = deviceId;
+			l->status = status;
+			l->channel = msg.getChannel();
+			l->number = msg.getNote();
+			// Program change and channel pressure carry no value byte
+			l->value = msg.getSize() >= 3 ? msg.getValue() : 0;
+			l->frame = frame;
+			debugMessagesEngine.endPush();
+		}
+		// CCs and program changes can be captured as scene
+		if (status == 0xb || status == 0xc) {
+			lastMidiMessage = (device << 20) | (status << 16) | (msg.getChannel() << 8) | msg.getNote();
+		}
+		if (learnMode && (status == 0xb || (status == 0x9 && msg.getValue() > 0))) {
+			learnMessage = (device << 20) | (status << 16) | (msg.getChannel() << 8) | msg.getNote();
+		}
+		processDriver(device, msg, frame);
+	}
+
+	void processDriver(int device, const midi::Message& msg, int64_t frame) {
+		uint16_t mask = dispatch.get()->ownerTable[device - 1][msg.getStatus() & 0x7][msg.getChannel() & 0x0f][msg.getNote() & 0x7f];
+		for (int i = 0; mask; i++, mask >>= 1) {
+			if (!(mask & 1)) continue;
+			T7Driver* d = driver[i];
+			DriverStats& stats = driverStats[i];
+			stats.matched.fetch_add(1, std::memory_order_relaxed);
+			if (d->processMessage(device, msg)) {
+				T7Event* e = events.beginPush();
+				if (e) {
+					if (d->getEvent(e)) {
+						e->frame = frame;
+						events.endPush();
+						stats.events.fetch_add(1, std::memory_order_relaxed);
 					}
 				}
+				else {
+					if (d->getEvent(&eventDropped)) stats.dropped.fetch_add(1, std::memory_order_relaxed);
+				}
 			}
-			default:
-				break;
 		}
 	}
 
@@ -381,19 +1217,27 @@ struct T7CtrlModule : Module {
 		return driversJ;
 	}
 
+	/** Loads the JSON mapping of all drivers in driversJ, invalid entries are described in mappingErrors */
 	void driverMappingFromJson(json_t* driversJ) {
+		mappingErrors.clear();
 		json_t* driverJ;
 		size_t driverIdx;
 		json_array_foreach(driversJ, driverIdx, driverJ) {
 			json_t* driverNameJ = json_object_get(driverJ, "driverName");
-			if (!driverNameJ) continue;
+			if (!json_is_string(driverNameJ)) {
+				mappingErrors.push_back(string::f("driver %i: missing driverName", (int)driverIdx + 1));
+				continue;
+			}
 			std::string driverName = json_string_value(driverNameJ);
+			bool found = false;
 			for (T7Driver* d : driver) {
-				if (d->getName() == driverName) {
-					d->fromJson(driverJ);
-				}
+				if (d->getName() != driverName) continue;
+				found = true;
+				d->fromJson(driverJ, mappingErrors);
 			}
+			if (!found) mappingErrors.push_back(string::f("driver %i: unknown driverName \"%s\"", (int)driverIdx + 1, driverName.c_str()));
 		}
+		buildDispatchTable();
 	}
 
 	json_t* dataToJson() override {
@@ -402,6 +1246,7 @@ struct T7CtrlModule : Module {
 
 		json_t* driversJ = driverMappingToJson();
 		json_object_set_new(rootJ, "driver", driversJ);
+		json_object_set_new(rootJ, "recording", recorder.toJson());
 		return rootJ;
 	}
 
@@ -410,6 +1255,8 @@ struct T7CtrlModule : Module {
 
 		json_t* driverJ = json_object_get(rootJ, "driver");
 		if (driverJ) driverMappingFromJson(driverJ);
+		json_t* recordingJ = json_object_get(rootJ, "recording");
+		if (recordingJ) recorder.fromJson(recordingJ);
 	}
 };
 
@@ -417,14 +1264,33 @@ struct T7CtrlModule : Module {
 struct MidiTextField : LedDisplayTextField {
 	T7CtrlModule* module;
 	const int MAX = 600;
+	/** More entries than this do not fit into MAX characters, older ones are not formatted */
+	static const int MAX_ENTRIES = 32;
+	T7CtrlModule::MidiLogEntry entries[MAX_ENTRIES];
 
 	void step() override {
 		LedDisplayTextField::step();
 		if (!module) return;
 
-		while (!module->debugMessagesEngine.empty()) {
-			std::string s = module->debugMessagesEngine.shift();
-			text = s + "\n" + text.substr(0, MAX);
+		int n = 0;
+		T7CtrlModule::MidiLogEntry* l;
+		while ((l = module->debugMessagesEngine.front())) {
+			entries[n % MAX_ENTRIES] = *l;
+			module->debugMessagesEngine.pop();
+			n++;
+		}
+		if (visible) {
+			for (int i = std::max(0, n - MAX_ENTRIES); i < n; i++) {
+				const T7CtrlModule::MidiLogEntry& e = entries[i % MAX_ENTRIES];
+				std::string s;
+				switch (e.status) {
+					case 0x8: s = string::f("in %i drv %i dev %i ch %i off %i vel %i", e.device, e.driverId, e.deviceId, e.channel + 1, e.number, e.value); break;
+					case 0x9: s = string::f("in %i drv %i dev %i ch %i on %i vel %i", e.device, e.driverId, e.deviceId, e.channel + 1, e.number, e.value); break;
+					case 0xc: s = string::f("in %i drv %i dev %i ch %i prg %i", e.device, e.driverId, e.deviceId, e.channel + 1, e.number); break;
+					default: s = string::f("in %i drv %i dev %i ch %i cc %i val %i", e.device, e.driverId, e.deviceId, e.channel + 1, e.number, e.value); break;
+				}
+				text = s + "\n" + text.substr(0, MAX);
+			}
 		}
 		while (!module->eventLogger.debugMessagesGui.empty()) {
 			std::string s = module->eventLogger.debugMessagesGui.shift();
@@ -446,9 +1312,17 @@ struct MidiDisplay : LedDisplay {
 
 struct T7CtrlWidget : ModuleWidget {
 	T7CtrlModule* module;
+	T7EventExecutor executor;
+	T7LatencyStats latency;
+	/** Learned MIDI message waiting for a port, see T7CtrlModule::learnMessage */
+	int learnPending = -1;
+	/** Selected widget when the MIDI message was learned */
+	Widget* learnWidget = NULL;
+
 	T7CtrlWidget(T7CtrlModule* module) {
 		setModule(module);
 		this->module = module;
+		if (module) executor.logger = &module->eventLogger;
 		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/T7Ctrl.svg")));
 
 		addChild(createWidget<ScrewBlack>(Vec(RACK_GRID_WIDTH, 0)));
@@ -497,8 +1371,203 @@ struct T7CtrlWidget : ModuleWidget {
 		menu->addChild(construct<ExampleMappingItem>(&MenuItem::text, "Example JSON mapping", &ExampleMappingItem::mw, this));
 		menu->addChild(construct<CopyMappingItem>(&MenuItem::text, "Copy JSON mapping", &CopyMappingItem::mw, this));
 		menu->addChild(construct<PasteMappingItem>(&MenuItem::text, "Paste JSON mapping", &PasteMappingItem::mw, this));
+
+		struct MappingErrorsItem : MenuItem {
+			T7CtrlModule* module;
+			MappingErrorsItem() {
+				rightText = RIGHT_ARROW;
+			}
+			Menu* createChildMenu() override {
+				Menu* menu = new Menu;
+				for (const std::string& s : module->mappingErrors) {
+					menu->addChild(construct<MenuLabel>(&MenuLabel::text, s));
+				}
+				return menu;
+			}
+		};
+
+		if (module->mappingErrors.size() > 0) {
+			menu->addChild(construct<MappingErrorsItem>(&MenuItem::text, string::f("Invalid mapping entries (%i)", (int)module->mappingErrors.size()), &MappingErrorsItem::module, module));
+		}
+		struct SceneMenuItem : MenuItem {
+			T7CtrlModule* module;
+			SceneMenuItem() {
+				rightText = RIGHT_ARROW;
+			}
+
+			Menu* createChildMenu() override {
+				struct CaptureItem : MenuItem {
+					T7CtrlModule* module;
+					int midiType;
+					int midiDevice;
+					int midiChannel;
+					int midiNumber;
+					void onAction(const event::Action& e) override {
+						module->sceneDriver->captureScene(midiType, midiDevice, midiChannel, midiNumber);
+						module->buildDispatchTable();
+					}
+				};
+
+				struct RemoveItem : MenuItem {
+					T7CtrlModule* module;
+					int sceneId;
+					void onAction(const event::Action& e) override {
+						module->sceneDriver->removeScene(sceneId);
+						module->buildDispatchTable();
+					}
+				};
+
+				Menu* menu = new Menu;
+				int m = module->lastMidiMessage;
+				if (m >= 0) {
+					int midiDevice = m >> 20;
+					int midiType = ((m >> 16) & 0xf) == 0xc ? 0 : 1;
+					int midiChannel = (m >> 8) & 0xff;
+					int midiNumber = m & 0xff;
+					std::string s = string::f("Capture cables for in %i ch %i %s %i", midiDevice, midiChannel + 1, midiType == 0 ? "program" : "cc", midiNumber);
+					menu->addChild(construct<CaptureItem>(&MenuItem::text, s, &CaptureItem::module, module, &CaptureItem::midiType, midiType, &CaptureItem::midiDevice, midiDevice, &CaptureItem::midiChannel, midiChannel, &CaptureItem::midiNumber, midiNumber));
+				}
+				else {
+					menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Send a CC or program change to capture cables"));
+				}
+
+				if (module->sceneDriver->sceneSet.latest->scenes.size() > 0) {
+					menu->addChild(new MenuSeparator());
+					menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Remove scene"));
+				}
+				for (size_t i = 0; i < module->sceneDriver->sceneSet.latest->scenes.size(); i++) {
+					const MidiScene<T7CtrlModule>::Scene& scene = module->sceneDriver->sceneSet.latest->scenes[i];
+					std::string device = scene.midiDevice == 0 ? "any" : string::f("in %i", scene.midiDevice);
+					std::string channel = scene.midiChannel < 0 ? "omni" : string::f("ch %i", scene.midiChannel + 1);
+					std::string s = string::f("%s %s %s %i (%i cables)", device.c_str(), channel.c_str(), scene.midiType == 0 ? "program" : "cc", scene.midiNumber, (int)scene.cables.size());
+					menu->addChild(construct<RemoveItem>(&MenuItem::text, s, &RemoveItem::module, module, &RemoveItem::sceneId, scene.id));
+				}
+				return menu;
+			}
+		};
+
+		struct RecordingMenuItem : MenuItem {
+			T7CtrlModule* module;
+			RecordingMenuItem() {
+				rightText = RIGHT_ARROW;
+			}
+
+			Menu* createChildMenu() override {
+				struct RecordItem : MenuItem {
+					T7CtrlModule* module;
+					void onAction(const event::Action& e) override {
+						module->recorder.startRecording(APP->engine->getFrame(), APP->engine->getSampleRate());
+					}
+				};
+
+				struct PlayItem : MenuItem {
+					T7CtrlModule* module;
+					void onAction(const event::Action& e) override {
+						module->recorder.startPlayback(APP->engine->getFrame(), APP->engine->getSampleRate());
+					}
+				};
+
+				struct StopItem : MenuItem {
+					T7CtrlModule* module;
+					void onAction(const event::Action& e) override {
+						module->recorder.stop(APP->engine->getFrame());
+					}
+				};
+
+				struct LoopItem : MenuItem {
+					T7CtrlModule* module;
+					void onAction(const event::Action& e) override {
+						module->recorder.loop ^= true;
+					}
+					void step() override {
+						rightText = module->recorder.loop ? "✔" : "";
+						MenuItem::step();
+					}
+				};
+
+				Menu* menu = new Menu;
+				T7Recorder& recorder = module->recorder;
+				switch (recorder.state) {
+					case T7Recorder::State::RECORDING:
+						menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Recording, %i cable changes", (int)recorder.entries.size())));
+						menu->addChild(construct<StopItem>(&MenuItem::text, "Stop recording", &StopItem::module, module));
+						break;
+					case T7Recorder::State::PLAYING:
+						menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Playing %i of %i cable changes", (int)recorder.position, (int)recorder.entries.size())));
+						menu->addChild(construct<StopItem>(&MenuItem::text, "Stop playback", &StopItem::module, module));
+						break;
+					default:
+						menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("%i cable changes, %.1f s", (int)recorder.entries.size(), recorder.getSeconds())));
+						menu->addChild(construct<RecordItem>(&MenuItem::text, "Record", &RecordItem::module, module));
+						if (recorder.entries.size() > 0) menu->addChild(construct<PlayItem>(&MenuItem::text, "Play", &PlayItem::module, module));
+						break;
+				}
+				menu->addChild(construct<LoopItem>(&MenuItem::text, "Loop", &LoopItem::module, module));
+				return menu;
+			}
+		};
+
 		menu->addChild(new MenuSeparator());
 		menu->addChild(construct<ReplaceCableItem>(&MenuItem::text, "Replace input cables", &ReplaceCableItem::module, module));
+		struct LearnItem : MenuItem {
+			T7CtrlWidget* mw;
+			void onAction(const event::Action& e) override {
+				mw->module->learnMode ^= true;
+				mw->module->learnMessage = -1;
+				mw->learnPending = -1;
+			}
+			void step() override {
+				rightText = mw->module->learnMode ? "✔" : "";
+				MenuItem::step();
+			}
+		};
+
+		menu->addChild(construct<LearnItem>(&MenuItem::text, "Learn mappings", &LearnItem::mw, this));
+		if (module->learnMode) menu->addChild(construct<MenuLabel>(&MenuLabel::text, "Send a CC or note, then click a port"));
+		menu->addChild(construct<SceneMenuItem>(&MenuItem::text, "Scenes", &SceneMenuItem::module, module));
+		menu->addChild(construct<RecordingMenuItem>(&MenuItem::text, "Recording", &RecordingMenuItem::module, module));
+		menu->addChild(new MenuSeparator());
+		menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Dropped MIDI messages: %u", module->midiOverflowCount.load(std::memory_order_relaxed))));
+		menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Dropped events: %u", module->events.overflowCount.load())));
+
+		struct LatencyResetItem : MenuItem {
+			T7CtrlWidget* mw;
+			void onAction(const event::Action& e) override {
+				mw->latency.reset();
+			}
+		};
+
+		menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Latency of %i events (ms)", latency.size())));
+		menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("min %.1f avg %.1f p99 %.1f", latency.getMin(), latency.getAvg(), latency.getP99())));
+		menu->addChild(construct<LatencyResetItem>(&MenuItem::text, "Reset latency", &LatencyResetItem::mw, this));
+
+		struct DriverStatsItem : MenuItem {
+			T7CtrlModule* module;
+			DriverStatsItem() {
+				rightText = RIGHT_ARROW;
+			}
+
+			Menu* createChildMenu() override {
+				struct ResetItem : MenuItem {
+					T7CtrlModule* module;
+					void onAction(const event::Action& e) override {
+						module->resetStats();
+					}
+				};
+
+				Menu* menu = new Menu;
+				for (size_t i = 0; i < module->driver.size() && i < T7CtrlModule::MAX_DRIVERS; i++) {
+					const T7CtrlModule::DriverStats& stats = module->driverStats[i];
+					menu->addChild(construct<MenuLabel>(&MenuLabel::text, module->driver[i]->getName()));
+					menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("seen %u matched %u events %u dropped %u", module->getSeenCount(i), stats.matched.load(std::memory_order_relaxed), stats.events.load(std::memory_order_relaxed), stats.dropped.load(std::memory_order_relaxed))));
+				}
+				menu->addChild(new MenuSeparator());
+				menu->addChild(construct<ResetItem>(&MenuItem::text, "Reset statistics", &ResetItem::module, module));
+				return menu;
+			}
+		};
+
+		menu->addChild(construct<DriverStatsItem>(&MenuItem::text, "Driver statistics", &DriverStatsItem::module, module));
 	}
 	
 	void exampleMapping() {
@@ -544,17 +1613,56 @@ struct T7CtrlWidget : ModuleWidget {
 		});
 
 		module->driverMappingFromJson(driverJ);
+		if (module->mappingErrors.size() > 0) {
+			std::string message = string::f("%i invalid mapping entries have been skipped:", (int)module->mappingErrors.size());
+			for (size_t i = 0; i < std::min<size_t>(module->mappingErrors.size(), 20); i++) {
+				message += "\n" + module->mappingErrors[i];
+			}
+			if (module->mappingErrors.size() > 20) message += "\n...";
+			osdialog_message(OSDIALOG_WARNING, OSDIALOG_OK, message.c_str());
+		}
+	}
+
+	/** Maps the last learned MIDI message to the next port which gets selected */
+	void learn() {
+		int m = module->learnMessage.exchange(-1);
+		if (m >= 0) {
+			learnPending = m;
+			learnWidget = APP->event->getSelectedWidget();
+		}
+		if (learnPending < 0) return;
+		Widget* w = APP->event->getSelectedWidget();
+		if (w == learnWidget) return;
+		learnWidget = w;
+		PortWidget* pw = dynamic_cast<PortWidget*>(w);
+		if (!pw || !pw->module || pw->module == module) return;
+		module->learnMapping(learnPending, pw->module->id, pw->type == engine::Port::OUTPUT ? 0 : 1, pw->portId);
+		learnPending = -1;
 	}
 
 	void step() override {
 		ModuleWidget::step();
 		if (!module) return;
 
-		while (module->events.size() > 0) {
-			T7Event* e = module->events.shift();
-			e->execute();
-			delete e;
+		if (module->learnMode) learn();
+
+		if (module->recorder.state == T7Recorder::State::PLAYING) {
+			module->recorder.play(APP->engine->getFrame(), executor);
+		}
+
+		if (module->events.empty()) return;
+		// All events of this frame result in a single undo step
+		executor.beginBatch();
+		int64_t frame = APP->engine->getFrame();
+		float sampleRate = APP->engine->getSampleRate();
+		T7Event* e;
+		while ((e = module->events.front())) {
+			T7EventType type = executor.execute(*e);
+			module->recorder.record(*e, type, frame);
+			if (e->frame >= 0) latency.push((frame - e->frame) * 1000.f / sampleRate);
+			module->events.pop();
 		}
+		executor.endBatch();
 	}
 };
 
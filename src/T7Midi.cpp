@@ -18,15 +18,14 @@ struct T7MidiModule : Module {
 	};
 
 	midi::InputQueue midiInput;
-
-	std::vector<T7MidiMessage> consumerMessage;
-	std::vector<T7MidiMessage> producerMessage;
+	/** Set if this module is chained to a T7-CTRL beyond T7MidiChain::MAX_LENGTH */
+	std::atomic<bool> outOfChain{false};
+	/** MIDI messages dropped because this module is out of chain */
+	std::atomic<uint32_t> outOfChainCount{0};
 
 	T7MidiModule() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		onReset();
-		leftExpander.consumerMessage = &consumerMessage;
-		leftExpander.producerMessage = &producerMessage;
 	}
 
 	void onReset() override {
@@ -34,27 +33,36 @@ struct T7MidiModule : Module {
 	}
 
 	void process(const ProcessArgs& args) override {
-		std::vector<T7MidiMessage>* queue = reinterpret_cast<std::vector<T7MidiMessage>*>(leftExpander.producerMessage);
-
 		midi::Message msg;
-		while (midiInput.tryPop(&msg, args.frame)) {
-			T7MidiMessage m;
-			m.driverId = midiInput.driverId;
-			m.deviceId = midiInput.deviceId;
-			m.msg = msg;
-			queue->push_back(m);
+		if (!midiInput.tryPop(&msg, args.frame)) return;
+
+		// Find the chain's T7-CTRL and this module's position in the chain
+		T7MidiQueue* queue = NULL;
+		Module* ml = leftExpander.module;
+		int i = 0;
+		while (ml && ml->model == modelT7Midi) {
+			ml = ml->leftExpander.module;
+			i++;
 		}
-
-		Module* mr = rightExpander.module;
-		if (mr && mr->model->plugin->slug == "Stoermelder-PackTau" && mr->model->slug == "T7Midi") {
-			std::vector<T7MidiMessage>* queue1 = reinterpret_cast<std::vector<T7MidiMessage>*>(mr->leftExpander.consumerMessage);
-			for (T7MidiMessage m : *queue1) queue->push_back(m);
-			queue1->clear();
-		}
-
-		if (queue->size() > 0) {
-			leftExpander.messageFlipRequested = true;
+		if (ml && ml->model == modelT7Ctrl && i < T7MidiChain::MAX_LENGTH) {
+			T7MidiChain* chain = reinterpret_cast<T7MidiChain*>(ml->rightExpander.consumerMessage);
+			queue = &chain->lanes[i];
 		}
+		outOfChain.store(ml && ml->model == modelT7Ctrl && !queue, std::memory_order_relaxed);
+
+		do {
+			if (!queue) {
+				if (outOfChain.load(std::memory_order_relaxed)) outOfChainCount.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+			T7MidiMessage* m = queue->beginPush();
+			if (!m) continue;
+			m->driverId = midiInput.driverId;
+			m->deviceId = midiInput.deviceId;
+			m->frame = msg.frame >= 0 ? msg.frame : args.frame;
+			m->msg = msg;
+			queue->endPush();
+		} while (midiInput.tryPop(&msg, args.frame));
 	}
 
 	json_t* dataToJson() override {
@@ -71,8 +79,13 @@ struct T7MidiModule : Module {
 
 
 struct T7MidiWidget : ModuleWidget {
+	T7MidiModule* module;
+	/** Last state of T7MidiModule::outOfChain, warned about once */
+	bool outOfChain = false;
+
 	T7MidiWidget(T7MidiModule* module) {
 		setModule(module);
+		this->module = module;
 		setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/T7Midi.svg")));
 
 		addChild(createWidget<ScrewBlack>(Vec(RACK_GRID_WIDTH, 0)));
@@ -85,6 +98,21 @@ struct T7MidiWidget : ModuleWidget {
 		midiWidget->setMidiPort(module ? &module->midiInput : NULL);
 		addChild(midiWidget);
 	}
+
+	void step() override {
+		ModuleWidget::step();
+		if (!module) return;
+		bool b = module->outOfChain.load(std::memory_order_relaxed);
+		if (b && !outOfChain) WARN("T7-MIDI %lld: T7-CTRL takes %i chained T7-MIDI at most, MIDI messages of this module are dropped", (long long)module->id, T7MidiChain::MAX_LENGTH);
+		outOfChain = b;
+	}
+
+	void appendContextMenu(Menu* menu) override {
+		if (!module->outOfChain.load(std::memory_order_relaxed)) return;
+		menu->addChild(new MenuSeparator());
+		menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Not connected, T7-CTRL takes %i chained T7-MIDI at most", T7MidiChain::MAX_LENGTH)));
+		menu->addChild(construct<MenuLabel>(&MenuLabel::text, string::f("Dropped MIDI messages: %u", module->outOfChainCount.load(std::memory_order_relaxed))));
+	}
 };
 
 } // namespace T7
@@ -13,6 +13,11 @@ enum class ModuleBrowserSort {
 	RANDOM = 4
 };
 
+/** Number of search results ordered by score, the remaining matches keep the sort order */
+static const size_t RANK_LIMIT = 100;
+/** Number of models processed by a worker at once */
+static const size_t CHUNK_SIZE = 1024;
+
 float modelBoxZoom = 0.9f;
 int modelBoxSort = (int)ModuleBrowserSort::DEFAULT;
 bool hideBrands = false;
@@ -20,47 +25,217 @@ bool searchDescriptions = false;
 
 // Static functions
 
-static float fuzzyScore(const std::string& s, const std::string& query) {
-	size_t pos = s.find(query);
-	if (pos == std::string::npos)
-		return 0.f;
+static bool isWordStart(const char* s, const char* p) {
+	return p == s || !std::isalnum((unsigned char)p[-1]);
+}
 
-	return (float)(query.size() + 1) / (s.size() + 1);
+static bool isWordEnd(const char* end, const char* p) {
+	return p == end || !std::isalnum((unsigned char)*p);
 }
 
-static float modelScore(plugin::Model* model, const std::string& search) {
-	if (search.empty())
-		return 1.f;
-	std::string s;
-	s += model->plugin->brand;
-	s += " ";
-	s += model->plugin->name;
-	s += " ";
-	s += model->name;
-	s += " ";
-	s += model->slug;
+/** Number of characters of a word which may have no match */
+static int maxTypos(const std::string& token) {
+	return token.size() >= 5 ? 1 : 0;
+}
+
+/**
+ * Scores a word of the query against the text of a model, 0 if it does not match.
+ * Contiguous matches anywhere in the text score best, especially at the start of a word.
+ * Otherwise the characters must appear in order within the model name and slug, as a whole
+ * text with tags and description contains the characters of almost any word. Consecutive
+ * characters and characters starting a word score higher. Characters are matched greedily
+ * from left to right, a longer word can only match if its beginning matches, see
+ * SearchIndex::narrows().
+ */
+static float fuzzyScore(const char* s, size_t len, const char* name, size_t nameLen, const std::string& token) {
+	const char* end = s + len;
+	float best = 0.f;
+	const char* p = s;
+	while ((p = std::search(p, end, token.begin(), token.end())) != end) {
+		float score = 1.f;
+		if (isWordStart(s, p)) score += 0.5f;
+		if (isWordEnd(end, p + token.size())) score += 0.25f;
+		best = std::max(best, score);
+		if (best >= 1.75f) break;
+		p++;
+	}
+	if (best > 0.f)
+		return best;
+
+	float score = 0.5f;
+	int typos = maxTypos(token);
+	const char* last = NULL;
+	const char* nameEnd = name + nameLen;
+	p = name;
+	for (char c : token) {
+		const char* q = std::find(p, nameEnd, c);
+		if (q == nameEnd) {
+			// Typo, skip the character
+			if (--typos < 0)
+				return 0.f;
+			score -= 0.1f;
+			continue;
+		}
+		if (last && q == last + 1) score += 0.05f;
+		else if (isWordStart(name, q)) score += 0.05f;
+		else score -= 0.02f;
+		last = q;
+		p = q + 1;
+	}
+	return std::max(score, 0.05f);
+}
+
+void SearchIndex::build() {
+	models.clear();
+	corpus.clear();
+	offsets.clear();
+	lengths.clear();
+	descriptionLengths.clear();
+	nameOffsets.clear();
+	nameLengths.clear();
+	brandIds.clear();
+	modelBrands.clear();
+	for (plugin::Plugin* plugin : rack::plugin::plugins) {
+		for (plugin::Model* model : plugin->models) {
+			add(model);
+		}
+	}
+	corpus = string::lowercase(corpus);
+	corpus.shrink_to_fit();
+
+	words = (models.size() + 63) / 64;
+	brandBits.assign(brandIds.size() * words, 0);
+	tagBits.assign(tag::tagAliases.size() * words, 0);
+	for (size_t i = 0; i < models.size(); i++) {
+		uint64_t bit = (uint64_t)1 << (i % 64);
+		brandBits[modelBrands[i] * words + i / 64] |= bit;
+		for (int tagId : models[i]->tagIds) {
+			tagBits[tagId * words + i / 64] |= bit;
+		}
+	}
+}
+
+void SearchIndex::add(plugin::Model* model) {
+	offsets.push_back(corpus.size());
+	models.push_back(model);
+	auto it = brandIds.find(model->plugin->brand);
+	if (it == brandIds.end())
+		it = brandIds.insert(std::make_pair(model->plugin->brand, (int)brandIds.size())).first;
+	modelBrands.push_back(it->second);
+	corpus += model->plugin->brand;
+	corpus += " ";
+	corpus += model->plugin->name;
+	corpus += " ";
+	nameOffsets.push_back(corpus.size() - offsets.back());
+	corpus += model->name;
+	corpus += " ";
+	corpus += model->slug;
+	nameLengths.push_back(corpus.size() - offsets.back() - nameOffsets.back());
 	for (int tagId : model->tagIds) {
 		// Add all aliases of a tag
 		for (const std::string& alias : rack::tag::tagAliases[tagId]) {
-			s += " ";
-			s += alias;
+			corpus += " ";
+			corpus += alias;
 		}
 	}
-	if(searchDescriptions){
-		s += " ";
-		s += model->description;
+	lengths.push_back(corpus.size() - offsets.back());
+	corpus += " ";
+	corpus += model->description;
+	descriptionLengths.push_back(corpus.size() - offsets.back());
+}
+
+float SearchIndex::score(int i, const std::vector<std::string>& tokens) const {
+	if (tokens.empty())
+		return 1.f;
+	size_t len = searchDescriptions ? descriptionLengths[i] : lengths[i];
+	float score = 0.f;
+	for (const std::string& token : tokens) {
+		const char* text = corpus.data() + offsets[i];
+		float s = fuzzyScore(text, len, text + nameOffsets[i], nameLengths[i], token);
+		if (s <= 0.f)
+			return 0.f;
+		score += s;
 	}
-	float score = fuzzyScore(string::lowercase(s), string::lowercase(search));
-	return score;
+	// Prefer models with less text on equal matches
+	return score / tokens.size() + 0.1f / (len + 1);
 }
 
-static bool isModelVisible(plugin::Model* model, const std::string& search, const bool& favourite, const std::string& brand, const std::set<int>& tagId, const bool& hidden) {
-	// Filter search query
-	if (search != "") {
-		float score = modelScore(model, search);
-		if (score <= 0.f)
-			return false;
+std::vector<std::string> SearchIndex::tokenize(const std::string& query) {
+	std::vector<std::string> tokens;
+	size_t pos = 0;
+	while (pos < query.size()) {
+		size_t end = query.find(' ', pos);
+		if (end == std::string::npos) end = query.size();
+		if (end > pos) tokens.push_back(query.substr(pos, end - pos));
+		pos = end + 1;
 	}
+	return tokens;
+}
+
+bool SearchIndex::narrows(const std::string& prev, const std::string& query) {
+	// Typing appends to the query, the words of prev are kept or the last one gets longer
+	if (query.compare(0, prev.size(), prev) != 0)
+		return false;
+	std::vector<std::string> p = tokenize(prev);
+	if (p.empty())
+		return true;
+	std::vector<std::string> q = tokenize(query);
+	// A longer word must not allow more typos
+	return maxTypos(p.back()) == maxTypos(q[p.size() - 1]);
+}
+
+WorkerPool::WorkerPool() {
+	int n = std::min(3, (int)std::thread::hardware_concurrency() - 1);
+	for (int i = 0; i < n; i++) {
+		threads.push_back(std::thread(&WorkerPool::work, this));
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		running = false;
+	}
+	workCv.notify_all();
+	for (std::thread& t : threads) {
+		t.join();
+	}
+}
+
+void WorkerPool::run(int chunks, std::function<void(int)> f) {
+	std::unique_lock<std::mutex> lock(mutex);
+	job = f;
+	this->chunks = chunks;
+	nextChunk = 0;
+	pendingChunks = chunks;
+	if (chunks > 1)
+		workCv.notify_all();
+	while (runChunk(lock));
+	doneCv.wait(lock, [&]() { return pendingChunks == 0; });
+}
+
+bool WorkerPool::runChunk(std::unique_lock<std::mutex>& lock) {
+	if (nextChunk >= chunks)
+		return false;
+	int c = nextChunk++;
+	lock.unlock();
+	job(c);
+	lock.lock();
+	if (--pendingChunks == 0)
+		doneCv.notify_all();
+	return true;
+}
+
+void WorkerPool::work() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (running) {
+		if (!runChunk(lock))
+			workCv.wait(lock);
+	}
+}
+
+static bool isModelVisible(const SearchIndex& index, int i, const bool& favourite, const std::string& brand, const std::set<int>& tagId, const bool& hidden) {
+	plugin::Model* model = index.models[i];
 
 	// Filter favorite
 	if (favourite) {
@@ -76,12 +251,9 @@ static bool isModelVisible(plugin::Model* model, const std::string& search, cons
 	}
 
 	// Filter tag
-	if (tagId.size() > 0) {
-			for (auto t : tagId) {
-			auto it = std::find(model->tagIds.begin(), model->tagIds.end(), t);
-			if (it == model->tagIds.end())
-				return false;
-		}
+	for (int t : tagId) {
+		if (!index.hasTag(i, t))
+			return false;
 	}
 
 	// Filter hidden
@@ -196,6 +368,8 @@ ModelZoomSlider::~ModelZoomSlider() {
 
 struct ModelBox : widget::OpaqueWidget {
 	plugin::Model* model;
+	/** Index into ModuleBrowser::searchIndex */
+	int modelIndex;
 	widget::Widget* previewWidget;
 	ui::Tooltip* tooltip = NULL;
 	/** Lazily created */
@@ -205,8 +379,9 @@ struct ModelBox : widget::OpaqueWidget {
 	float modelBoxWidth = -1.f;
 	bool modelHidden = false;
 
-	void setModel(plugin::Model* model) {
+	void setModel(plugin::Model* model, int modelIndex) {
 		this->model = model;
+		this->modelIndex = modelIndex;
 		previewWidget = new widget::TransparentWidget;
 		addChild(previewWidget);
 	}
@@ -464,6 +639,7 @@ struct SortChoice : ui::ChoiceButton {
 			void onAction(const event::Action& e) override {
 				ModuleBrowser* browser = APP->scene->browser->getFirstDescendantOfType<ModuleBrowser>();
 				modelBoxSort = (int)sort;
+				browser->sortDirty = true;
 				browser->refresh(true);
 			}
 		};
@@ -510,6 +686,8 @@ struct FavoriteItem : ui::MenuItem {
 
 
 struct BrandItem : ui::MenuItem {
+	/** See SearchIndex::brandIds */
+	int brandId = -1;
 	void onAction(const event::Action& e) override {
 		ModuleBrowser* browser = getAncestorOfType<ModuleBrowser>();
 		if (browser->brand == text)
@@ -774,12 +952,26 @@ ModuleBrowser::ModuleBrowser() {
 	modelMargin->addChild(modelContainer);
 
 	// Add ModelBoxes for each Model
-	for (plugin::Plugin* plugin : rack::plugin::plugins) {
-		for (plugin::Model* model : plugin->models) {
-			ModelBox* moduleBox = new ModelBox;
-			moduleBox->setModel(model);
-			modelContainer->addChild(moduleBox);
-		}
+	searchIndex.build();
+	for (int i = 0; i < (int)searchIndex.models.size(); i++) {
+		ModelBox* moduleBox = new ModelBox;
+		moduleBox->setModel(searchIndex.models[i], i);
+		// Shown by refresh()
+		moduleBox->visible = false;
+		modelContainer->addChild(moduleBox);
+		modelBoxes.push_back(moduleBox);
+		boxPositions.push_back(std::prev(modelContainer->children.end()));
+	}
+	scores.resize(modelBoxes.size());
+	ranked.reserve(modelBoxes.size());
+	sortPositions.resize(modelBoxes.size());
+
+	for (Widget* w : sidebar->brandList->children) {
+		BrandItem* item = dynamic_cast<BrandItem*>(w);
+		assert(item);
+		auto it = searchIndex.brandIds.find(item->text);
+		if (it != searchIndex.brandIds.end())
+			item->brandId = it->second;
 	}
 
 	clear(false);
@@ -815,12 +1007,77 @@ void ModuleBrowser::refresh(bool resetScroll) {
 		modelScroll->offset = math::Vec();
 	}
 
-	// Filter ModelBoxes
-	for (Widget* w : modelContainer->children) {
-		ModelBox* m = dynamic_cast<ModelBox*>(w);
-		assert(m);
-		m->visible = isModelVisible(m->model, search, favorites, brand, tagId, hidden);
-		if (hidden && m->visible) m->modelHidden = isModelHidden(m->model);
+	// The index is lowercased already
+	std::string query = string::lowercase(search);
+
+	std::vector<std::string> tokens = SearchIndex::tokenize(query);
+
+	// Models matching the query, an extended query can only match a subset of the previous
+	// matches, any other change requires a full pass
+	bool narrow = searchMatchesValid && searchMatchesDescriptions == searchDescriptions && SearchIndex::narrows(searchMatchesQuery, query);
+	if (!narrow) {
+		searchMatches.resize(searchIndex.models.size());
+		for (int i = 0; i < (int)searchMatches.size(); i++)
+			searchMatches[i] = i;
+	}
+	// Passes over the models are split into chunks which run in parallel, each chunk
+	// collects its results separately, merged in order afterwards
+	auto chunkCount = [](size_t n) {
+		return (int)((n + CHUNK_SIZE - 1) / CHUNK_SIZE);
+	};
+	auto merge = [](std::vector<int>& v, std::vector<std::vector<int>>& chunks, int count) {
+		v.clear();
+		for (int c = 0; c < count; c++)
+			v.insert(v.end(), chunks[c].begin(), chunks[c].end());
+	};
+	int chunks = chunkCount(searchMatches.size());
+	if ((int)chunkMatches.size() < chunks) {
+		chunkMatches.resize(chunks);
+		chunkFiltered.resize(chunks);
+	}
+	pool.run(chunks, [&](int c) {
+		std::vector<int>& matches = chunkMatches[c];
+		matches.clear();
+		size_t end = std::min(searchMatches.size(), (c + 1) * CHUNK_SIZE);
+		for (size_t j = c * CHUNK_SIZE; j < end; j++) {
+			int i = searchMatches[j];
+			scores[i] = searchIndex.score(i, tokens);
+			if (scores[i] > 0.f)
+				matches.push_back(i);
+		}
+	});
+	merge(searchMatches, chunkMatches, chunks);
+	searchMatchesQuery = query;
+	searchMatchesDescriptions = searchDescriptions;
+	searchMatchesValid = true;
+
+	// Filter ModelBoxes, only models matching the query can be visible. Brands and tags are
+	// offered for models that would be visible by the search query, favorites and hidden only.
+	chunks = chunkCount(searchMatches.size());
+	pool.run(chunks, [&](int c) {
+		std::vector<int>& visible = chunkMatches[c];
+		std::vector<int>& filtered = chunkFiltered[c];
+		visible.clear();
+		filtered.clear();
+		size_t end = std::min(searchMatches.size(), (c + 1) * CHUNK_SIZE);
+		for (size_t j = c * CHUNK_SIZE; j < end; j++) {
+			int i = searchMatches[j];
+			if (!isModelVisible(searchIndex, i, favorites, "", emptyTagId, hidden))
+				continue;
+			filtered.push_back(i);
+			if (isModelVisible(searchIndex, i, favorites, brand, tagId, hidden))
+				visible.push_back(i);
+		}
+	});
+	for (int i : visibleModels)
+		modelBoxes[i]->visible = false;
+	merge(visibleModels, chunkMatches, chunks);
+	std::vector<int> filteredModels;
+	merge(filteredModels, chunkFiltered, chunks);
+	for (int i : visibleModels) {
+		ModelBox* m = modelBoxes[i];
+		m->visible = true;
+		if (hidden) m->modelHidden = isModelHidden(m->model);
 	}
 
 	// Sort ModelBoxes
@@ -863,59 +1120,85 @@ void ModuleBrowser::refresh(bool resetScroll) {
 		return t1 < t2;
 	};
 
-	switch ((ModuleBrowserSort)modelBoxSort) {
-		case ModuleBrowserSort::DEFAULT:
-			modelContainer->children.sort(sortDefault);
-			break;
-		case ModuleBrowserSort::NAME:
-			modelContainer->children.sort(sortByName);
-			break;
-		case ModuleBrowserSort::LAST_USED:
-			modelContainer->children.sort(sortByLastUsed);
-			break;
-		case ModuleBrowserSort::MOST_USED:
-			modelContainer->children.sort(sortByMostUsed);
-			break;
-		case ModuleBrowserSort::RANDOM:
-			std::vector<std::reference_wrapper<Widget*>> vec(modelContainer->children.begin(), modelContainer->children.end());
-			std::random_shuffle(vec.begin(), vec.end());
-			std::list<Widget*> s(vec.begin(), vec.end());
-			modelContainer->children.swap(s);
-			break;
-	}
-
-
-	if (!search.empty()) {
-		std::map<Widget*, float> scores;
-		// Compute scores
+	// Restore the sort order after the search query has been cleared
+	if (rankedOrder && tokens.empty())
+		sortDirty = true;
+
+	if (sortDirty) {
+		switch ((ModuleBrowserSort)modelBoxSort) {
+			case ModuleBrowserSort::DEFAULT:
+				modelContainer->children.sort(sortDefault);
+				break;
+			case ModuleBrowserSort::NAME:
+				modelContainer->children.sort(sortByName);
+				break;
+			case ModuleBrowserSort::LAST_USED:
+				modelContainer->children.sort(sortByLastUsed);
+				break;
+			case ModuleBrowserSort::MOST_USED:
+				modelContainer->children.sort(sortByMostUsed);
+				break;
+			case ModuleBrowserSort::RANDOM:
+				// Reorder the existing list nodes, boxPositions must stay valid
+				std::vector<int> vec(modelBoxes.size());
+				for (int i = 0; i < (int)vec.size(); i++)
+					vec[i] = i;
+				std::random_shuffle(vec.begin(), vec.end());
+				for (int i : vec)
+					modelContainer->children.splice(modelContainer->children.end(), modelContainer->children, boxPositions[i]);
+				break;
+		}
+		int k = 0;
 		for (Widget* w : modelContainer->children) {
-			ModelBox* m = dynamic_cast<ModelBox*>(w);
-			assert(m);
-			if (!m->visible)
-				continue;
-			scores[m] = modelScore(m->model, search);
+			ModelBox* m = static_cast<ModelBox*>(w);
+			sortPositions[m->modelIndex] = k++;
 		}
+		sortDirty = false;
+		rankedOrder = false;
+	}
+
+	// Order the matches of a search query by score, the best RANK_LIMIT models first
+	// followed by the remaining ones in sort order
+	if (!tokens.empty()) {
+		auto bySortPosition = [&](int i1, int i2) {
+			return sortPositions[i1] < sortPositions[i2];
+		};
+		auto byScore = [&](int i1, int i2) {
+			if (scores[i1] != scores[i2])
+				return scores[i1] > scores[i2];
+			return sortPositions[i1] < sortPositions[i2];
+		};
+		ranked.assign(visibleModels.begin(), visibleModels.end());
+		size_t k = std::min(ranked.size(), RANK_LIMIT);
+		std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end(), byScore);
+		std::sort(ranked.begin() + k, ranked.end(), bySortPosition);
+		// Move the visible ModelBoxes to the front, hidden ones are not laid out
+		std::list<Widget*>& children = modelContainer->children;
+		for (auto it = ranked.rbegin(); it != ranked.rend(); it++)
+			children.splice(children.begin(), children, boxPositions[*it]);
+		rankedOrder = true;
 	}
 
 	// Filter the brand and tag lists
 
-	// Get modules that would be filtered by just the search query
-	std::vector<plugin::Model*> filteredModels;
-	for (Widget* w : modelContainer->children) {
-		ModelBox* m = dynamic_cast<ModelBox*>(w);
-		assert(m);
-		if (isModelVisible(m->model, search, favorites, "", emptyTagId, hidden))
-			filteredModels.push_back(m->model);
+	// A brand is available if one of its models has all selected tags, a tag is available
+	// if a model of the selected brand has all selected tags and this one. Both are counted
+	// by intersecting the filtered models with the bitsets of the search index.
+	size_t words = searchIndex.words;
+	facetBits.assign(words, 0);
+	for (int i : filteredModels) {
+		facetBits[i / 64] |= (uint64_t)1 << (i % 64);
 	}
-
-	auto hasModel = [&](const std::string& brand, int itemTagId = -1) -> bool {
-		std::set<int> tagIdp1 = tagId;
-		if (itemTagId >= 0) tagIdp1.insert(itemTagId);
-		for (plugin::Model* model : filteredModels) {
-			if (isModelVisible(model, "", favorites, brand, tagIdp1, hidden))
-				return true;
-		}
-		return false;
+	for (int t : tagId) {
+		const uint64_t* tagBits = searchIndex.tagSet(t);
+		for (size_t j = 0; j < words; j++)
+			facetBits[j] &= tagBits[j];
+	}
+	auto countModels = [&](const uint64_t* bits) {
+		int n = 0;
+		for (size_t j = 0; j < words; j++)
+			n += __builtin_popcountll(facetBits[j] & bits[j]);
+		return n;
 	};
 
 	// Enable brand and tag items that are available in visible ModelBoxes
@@ -923,29 +1206,30 @@ void ModuleBrowser::refresh(bool resetScroll) {
 	for (Widget* w : sidebar->brandList->children) {
 		BrandItem* item = dynamic_cast<BrandItem*>(w);
 		assert(item);
-		item->disabled = !hasModel(item->text);
+		item->disabled = item->brandId < 0 || countModels(searchIndex.brandSet(item->brandId)) == 0;
 		if (!item->disabled)
 			brandsLen++;
 	}
 	sidebar->brandLabel->text = string::f("Brands (%d)", brandsLen);
 
+	if (brand != "") {
+		auto it = searchIndex.brandIds.find(brand);
+		const uint64_t* brandBits = it != searchIndex.brandIds.end() ? searchIndex.brandSet(it->second) : NULL;
+		for (size_t j = 0; j < words; j++)
+			facetBits[j] &= brandBits ? brandBits[j] : 0;
+	}
+
 	int tagsLen = 0;
 	for (Widget* w : sidebar->tagList->children) {
 		TagItem* item = dynamic_cast<TagItem*>(w);
 		assert(item);
-		item->disabled = !hasModel(brand, item->tagId);
+		item->disabled = countModels(searchIndex.tagSet(item->tagId)) == 0;
 		if (!item->disabled)
 			tagsLen++;
 	}
 	sidebar->tagLabel->text = string::f("Tags (%d)", tagsLen);
 
-	// Count models
-	int modelsLen = 0;
-	for (Widget* w : modelContainer->children) {
-		if (w->visible)
-			modelsLen++;
-	}
-	modelLabel->text = string::f("Modules (%d)", modelsLen);
+	modelLabel->text = string::f("Modules (%d)", (int)visibleModels.size());
 }
 
 void ModuleBrowser::clear(bool keepSearch) {
@@ -961,6 +1245,8 @@ void ModuleBrowser::clear(bool keepSearch) {
 }
 
 void ModuleBrowser::onShow(const event::Show& e) {
+	// Usage data might have changed
+	sortDirty = true;
 	refresh(false);
 	OpaqueWidget::onShow(e);
 }
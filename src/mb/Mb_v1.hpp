@@ -1,5 +1,9 @@
 #include "Mb.hpp"
 #include <plugin.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 namespace Mb {
 namespace v1 {
@@ -17,6 +21,70 @@ struct ModelZoomSlider : ui::Slider {
 	~ModelZoomSlider();
 };
 
+/** Lowercased search text of all models, built once when the browser is created */
+struct SearchIndex {
+	/** All models, the position within this vector is the model's index */
+	std::vector<plugin::Model*> models;
+	/** Text of all models, each consisting of brand, names, slug, tag aliases and description */
+	std::string corpus;
+	/** Start of each model's text within corpus */
+	std::vector<uint32_t> offsets;
+	/** Length of each model's text without and with the description */
+	std::vector<uint32_t> lengths;
+	std::vector<uint32_t> descriptionLengths;
+	/** Start and length of each model's name and slug within its text, the only part matched fuzzily */
+	std::vector<uint32_t> nameOffsets;
+	std::vector<uint32_t> nameLengths;
+	/** Id of each distinct brand and the brand id of each model */
+	std::map<std::string, int> brandIds;
+	std::vector<int> modelBrands;
+	/** Bitsets over the model index with 64 models per word, one for each brand and tag */
+	size_t words = 0;
+	std::vector<uint64_t> brandBits;
+	std::vector<uint64_t> tagBits;
+
+	const uint64_t* brandSet(int brandId) const {
+		return brandBits.data() + brandId * words;
+	}
+	const uint64_t* tagSet(int tagId) const {
+		return tagBits.data() + tagId * words;
+	}
+	bool hasTag(int i, int tagId) const {
+		return (tagSet(tagId)[i / 64] >> (i % 64)) & 1;
+	}
+
+	void build();
+	void add(plugin::Model* model);
+	/** Returns 0 if the model does not match all tokens, see tokenize() */
+	float score(int i, const std::vector<std::string>& tokens) const;
+	/** Splits a lowercased query into words */
+	static std::vector<std::string> tokenize(const std::string& query);
+	/** Returns true if the models matching query are a subset of the models matching prev */
+	static bool narrows(const std::string& prev, const std::string& query);
+};
+
+/** Few worker threads which split loops over the models into chunks, UI thread only */
+struct WorkerPool {
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable workCv;
+	std::condition_variable doneCv;
+	std::function<void(int)> job;
+	int chunks = 0;
+	int nextChunk = 0;
+	int pendingChunks = 0;
+	bool running = true;
+
+	WorkerPool();
+	~WorkerPool();
+	/** Calls f for every chunk and returns when all chunks are done, the calling thread helps out */
+	void run(int chunks, std::function<void(int)> f);
+	bool runChunk(std::unique_lock<std::mutex>& lock);
+	void work();
+};
+
+struct ModelBox;
+
 struct BrowserSidebar : widget::Widget {
 	ui::TextField* searchField;
 	ui::Button* clearButton;
@@ -48,6 +116,36 @@ struct ModuleBrowser : widget::OpaqueWidget {
 	bool hidden;
 	std::set<int> emptyTagId;
 
+	SearchIndex searchIndex;
+	/** ModelBoxes by model index */
+	std::vector<ModelBox*> modelBoxes;
+	/** Models matching searchMatchesQuery, narrowed as long as the query only gets longer */
+	std::vector<int> searchMatches;
+	std::string searchMatchesQuery;
+	bool searchMatchesDescriptions = false;
+	bool searchMatchesValid = false;
+	/** Models of the visible ModelBoxes */
+	std::vector<int> visibleModels;
+	/** The order of the ModelBoxes does not depend on the filters, sort only when needed */
+	bool sortDirty = true;
+	/** Search scores by model index, valid for searchMatches */
+	std::vector<float> scores;
+	/** Visible models in order of their score, preallocated */
+	std::vector<int> ranked;
+	/** Position of each model in the sort order */
+	std::vector<int> sortPositions;
+	/** Position of each ModelBox within modelContainer's children, stays valid while reordering */
+	std::vector<std::list<Widget*>::iterator> boxPositions;
+	/** ModelBoxes are ordered by score instead of the sort order */
+	bool rankedOrder = false;
+
+	WorkerPool pool;
+	/** Results of each chunk of a parallel pass, merged in order */
+	std::vector<std::vector<int>> chunkMatches;
+	std::vector<std::vector<int>> chunkFiltered;
+	/** Filtered models as bitset, see SearchIndex::words */
+	std::vector<uint64_t> facetBits;
+
 	ModuleBrowser();
 	void step() override;
 	void draw(const DrawArgs& args) override;